@@ -0,0 +1,226 @@
+#include "access_log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#define LINE_SIZE (ACCESS_LOG_PATH_SIZE + 128)
+
+// What a request thread hands to the writer
+typedef struct access_record_st {
+    long long time_us;      //wall clock at completion
+    long long latency_us;
+    unsigned long long bytes;
+    int status;
+    char method[12];
+    char path[ACCESS_LOG_PATH_SIZE];
+} access_record;
+
+// Producer and consumer indexes on separate cache lines
+typedef struct log_ring_st {
+    _Alignas(64) atomic_ullong head;    //written by the producer
+    _Alignas(64) atomic_ullong tail;    //written by the writer thread
+    _Alignas(64) atomic_ullong drops;
+    access_record records[ACCESS_LOG_RING_SIZE];
+} log_ring;
+
+static const char *log_path;
+static int log_fd = -1;
+static atomic_int started;
+static atomic_int stopping;
+static volatile sig_atomic_t reopen_requested;
+static pthread_t writer;
+
+static _Atomic(log_ring *) rings[ACCESS_LOG_MAX_THREADS];
+static atomic_int ring_count;
+static _Thread_local log_ring *my_ring;
+static _Thread_local int my_ring_failed;
+
+static log_ring *ring() {
+    if (my_ring == NULL && !my_ring_failed) {
+        const int index = atomic_fetch_add(&ring_count, 1);
+        log_ring *r = index < ACCESS_LOG_MAX_THREADS ? calloc(1, sizeof(log_ring)) : NULL;
+        if (r == NULL) {
+            my_ring_failed = 1;
+            return NULL;
+        }
+        atomic_store_explicit(&rings[index], r, memory_order_release);
+        my_ring = r;
+    }
+    return my_ring;
+}
+
+void access_log_record(const char *method, const char *path, const int status_code, const size_t bytes_sent,
+                       const long long latency_us) {
+    if (!atomic_load_explicit(&started, memory_order_relaxed))
+        return;
+    log_ring *r = ring();
+    if (r == NULL)
+        return;
+
+    const unsigned long long head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&r->tail, memory_order_acquire) >= ACCESS_LOG_RING_SIZE) {
+        atomic_store_explicit(&r->drops, atomic_load_explicit(&r->drops, memory_order_relaxed) + 1,
+                              memory_order_relaxed);
+        return;
+    }
+
+    access_record *record = &r->records[head % ACCESS_LOG_RING_SIZE];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    record->time_us = (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    record->latency_us = latency_us;
+    record->bytes = bytes_sent;
+    record->status = status_code;
+    strncpy(record->method, method, sizeof(record->method) - 1);
+    record->method[sizeof(record->method) - 1] = '\0';
+    strncpy(record->path, path, sizeof(record->path) - 1);
+    record->path[sizeof(record->path) - 1] = '\0';
+
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+// One line: time "METHOD path" status bytes latency-seconds
+static int format_record(const access_record *record, char *line) {
+    const time_t seconds = record->time_us / 1000000;
+    struct tm tm;
+    gmtime_r(&seconds, &tm);
+    int n = (int)strftime(line, LINE_SIZE, "%Y-%m-%dT%H:%M:%S", &tm);
+
+    // Keep the line parseable whatever the client put in the path
+    char path[ACCESS_LOG_PATH_SIZE];
+    size_t i;
+    for (i = 0; record->path[i]; i++) {
+        const unsigned char c = record->path[i];
+        path[i] = c < 0x20 || c >= 0x7f || c == '"' ? '?' : c;
+    }
+    path[i] = '\0';
+
+    n += snprintf(line + n, LINE_SIZE - n, ".%06lldZ \"%s %s\" %d %llu %.6f\n",
+                  record->time_us % 1000000, record->method, path, record->status, record->bytes,
+                  record->latency_us / 1e6);
+    return n < LINE_SIZE ? n : LINE_SIZE - 1;
+}
+
+static void open_log() {
+    const int fd = open(log_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("access log");
+        return;
+    }
+    if (log_fd >= 0)
+        close(log_fd);
+    log_fd = fd;
+}
+
+static void flush_lines(struct iovec *iov, int count) {
+    if (count == 0 || log_fd < 0)
+        return;
+    if (writev(log_fd, iov, count) < 0)
+        perror("access log");
+}
+
+// Drains every ring once. Returns the number of records written
+static int drain(char (*lines)[LINE_SIZE], struct iovec *iov) {
+    int written = 0, batched = 0;
+    const int count = atomic_load(&ring_count);
+    for (int i = 0; i < count && i < ACCESS_LOG_MAX_THREADS; i++) {
+        log_ring *r = atomic_load_explicit(&rings[i], memory_order_acquire);
+        if (r == NULL)
+            continue;
+
+        unsigned long long tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        const unsigned long long head = atomic_load_explicit(&r->head, memory_order_acquire);
+        while (tail < head) {
+            iov[batched].iov_base = lines[batched];
+            iov[batched].iov_len = format_record(&r->records[tail % ACCESS_LOG_RING_SIZE], lines[batched]);
+            batched++;
+            tail++;
+
+            // The record is copied into the line, its slot can be reused
+            atomic_store_explicit(&r->tail, tail, memory_order_release);
+            if (batched == ACCESS_LOG_BATCH) {
+                flush_lines(iov, batched);
+                written += batched;
+                batched = 0;
+            }
+        }
+    }
+    flush_lines(iov, batched);
+    return written + batched;
+}
+
+static void *writer_main(void *arg) {
+    (void)arg;
+    char (*lines)[LINE_SIZE] = malloc(ACCESS_LOG_BATCH * LINE_SIZE);
+    struct iovec iov[ACCESS_LOG_BATCH];
+    if (lines == NULL) {
+        perror("access log");
+        return NULL;
+    }
+
+    while (1) {
+        if (reopen_requested) {
+            reopen_requested = 0;
+            open_log();
+        }
+
+        const int stop = atomic_load(&stopping);
+        if (drain(lines, iov) == 0) {
+            if (stop)
+                break;
+            const struct timespec idle = {0, ACCESS_LOG_IDLE_MS * 1000000L};
+            nanosleep(&idle, NULL);
+        }
+    }
+
+    free(lines);
+    return NULL;
+}
+
+int access_log_start(const char *path) {
+    log_path = path;
+    open_log();
+    if (log_fd < 0)
+        return -1;
+
+    if (pthread_create(&writer, NULL, writer_main, NULL) != 0) {
+        perror("pthread_create");
+        close(log_fd);
+        log_fd = -1;
+        return -1;
+    }
+    atomic_store(&started, 1);
+    return 0;
+}
+
+void access_log_reopen() {
+    reopen_requested = 1;
+}
+
+unsigned long long access_log_drops() {
+    unsigned long long drops = 0;
+    const int count = atomic_load(&ring_count);
+    for (int i = 0; i < count && i < ACCESS_LOG_MAX_THREADS; i++) {
+        log_ring *r = atomic_load_explicit(&rings[i], memory_order_acquire);
+        if (r != NULL)
+            drops += atomic_load_explicit(&r->drops, memory_order_relaxed);
+    }
+    return drops;
+}
+
+void access_log_stop() {
+    if (!atomic_load(&started))
+        return;
+    atomic_store(&started, 0);
+    atomic_store(&stopping, 1);
+    pthread_join(writer, NULL);
+    close(log_fd);
+    log_fd = -1;
+}
@@ -0,0 +1,55 @@
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <stddef.h>
+#include "threadpool.h"
+
+/**
+ * access_log.h
+ *
+ * Asynchronous access log. Request threads copy a fixed-size binary
+ * record into a single-producer/single-consumer ring of their own and
+ * return; a background thread formats the records and appends them to
+ * the log with batched writev. When a ring is full the record is
+ * dropped and counted, a request never waits for the disk.
+ *
+ * Enabled by setting HTTP_SERVER_ACCESS_LOG to the log file path.
+ */
+
+#define ACCESS_LOG_ENV "HTTP_SERVER_ACCESS_LOG"
+#define ACCESS_LOG_MAX_THREADS (MAXT_IN_POOL + 8)
+#define ACCESS_LOG_RING_SIZE 1024   //records per thread, a power of two
+#define ACCESS_LOG_PATH_SIZE 120    //longer paths are truncated
+#define ACCESS_LOG_BATCH 64         //lines per writev
+#define ACCESS_LOG_IDLE_MS 10       //writer sleep when every ring is empty
+
+/**
+ * access_log_start opens "path" for appending and starts the writer
+ * thread. Returns 0 on success, -1 on failure.
+ */
+int access_log_start(const char *path);
+
+/**
+ * access_log_record queues one request. Does nothing if the log was
+ * not started.
+ */
+void access_log_record(const char *method, const char *path, int status_code, size_t bytes_sent,
+                       long long latency_us);
+
+/**
+ * access_log_reopen asks the writer to reopen the log file, so it can
+ * be rotated. Async-signal-safe, meant for a SIGHUP handler.
+ */
+void access_log_reopen();
+
+/**
+ * access_log_drops returns the number of records dropped on full rings.
+ */
+unsigned long long access_log_drops();
+
+/**
+ * access_log_stop writes out every queued record and stops the writer.
+ */
+void access_log_stop();
+
+#endif
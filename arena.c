@@ -0,0 +1,81 @@
+#include "arena.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdalign.h>
+
+#define ARENA_ALIGN alignof(max_align_t)
+
+struct arena_chunk_st {
+    struct arena_chunk_st *next;
+    alignas(ARENA_ALIGN) char data[];
+};
+
+void arena_init(arena *a, void *memory, const size_t size) {
+    a->base = memory;
+    a->size = size;
+    a->used = 0;
+    a->overflow = NULL;
+}
+
+void *arena_alloc(arena *a, const size_t size) {
+    const size_t start = (a->used + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    if (start <= a->size && size <= a->size - start) {
+        a->used = start + size;
+        return a->base + start;
+    }
+
+    arena_chunk *chunk = malloc(sizeof(arena_chunk) + size);
+    if (chunk == NULL)
+        return NULL;
+    chunk->next = a->overflow;
+    a->overflow = chunk;
+    return chunk->data;
+}
+
+char *arena_strndup(arena *a, const char *str, const size_t len) {
+    char *copy = arena_alloc(a, len + 1);
+    if (copy == NULL)
+        return NULL;
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+char *arena_printf(arena *a, size_t *length, const char *format, ...) {
+    // Try the free tail of the block first, it is usually big enough
+    char *out = a->base + a->used;
+    const size_t room = a->size - a->used;
+
+    va_list args;
+    va_start(args, format);
+    const int n = vsnprintf(out, room, format, args);
+    va_end(args);
+    if (n < 0)
+        return NULL;
+
+    if ((size_t)n < room) {
+        a->used += n + 1;
+    } else {
+        out = arena_alloc(a, n + 1);
+        if (out == NULL)
+            return NULL;
+        va_start(args, format);
+        vsnprintf(out, n + 1, format, args);
+        va_end(args);
+    }
+
+    if (length != NULL)
+        *length = n;
+    return out;
+}
+
+void arena_reset(arena *a) {
+    while (a->overflow != NULL) {
+        arena_chunk *next = a->overflow->next;
+        free(a->overflow);
+        a->overflow = next;
+    }
+    a->used = 0;
+}
@@ -0,0 +1,54 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/**
+ * arena.h
+ *
+ * A bump-pointer allocator over a caller supplied block. Allocations are
+ * never freed one by one; arena_reset releases all of them at once. A
+ * request that does not fit in the block is served from the heap and
+ * freed by the next reset, so a large allocation costs more but never fails
+ * just because the block is full.
+ */
+
+typedef struct arena_chunk_st arena_chunk;
+
+typedef struct arena_st {
+    char *base;
+    size_t size;
+    size_t used;
+    arena_chunk *overflow;  //heap chunks, freed on reset
+} arena;
+
+/**
+ * arena_init makes "memory" (of "size" bytes) the arena's block.
+ */
+void arena_init(arena *a, void *memory, size_t size);
+
+/**
+ * arena_alloc returns "size" bytes aligned for any type, or NULL if the
+ * block is full and the heap is exhausted.
+ */
+void *arena_alloc(arena *a, size_t size);
+
+/**
+ * arena_strndup copies "len" bytes of "str" into the arena and
+ * null-terminates the copy.
+ */
+char *arena_strndup(arena *a, const char *str, size_t len);
+
+/**
+ * arena_printf formats into the arena. Returns the string and stores its
+ * length (without the terminator) in "length" if it is not NULL.
+ */
+char *arena_printf(arena *a, size_t *length, const char *format, ...)
+    __attribute__((format(printf, 3, 4)));
+
+/**
+ * arena_reset releases every allocation made since arena_init.
+ */
+void arena_reset(arena *a);
+
+#endif
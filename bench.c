@@ -0,0 +1,186 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+
+/**
+ * bench.c
+ *
+ * Loopback load generator. Each thread opens a connection, sends one
+ * "Connection: close" request, reads the response to EOF and repeats,
+ * so servers without keep-alive are measured on equal terms.
+ *
+ * Usage: bench <port> <connections> <seconds> [path]
+ */
+
+#define MAX_CONNECTIONS 1024
+#define RESPONSE_BUFFER_SIZE 65536
+
+// Per-thread results, merged once the run is over
+typedef struct worker_st {
+    pthread_t thread;
+    unsigned long long ok;
+    unsigned long long failed;
+    unsigned long long bytes;
+    long long *latencies_us;
+    size_t latency_count;
+    size_t latency_capacity;
+} worker;
+
+static struct sockaddr_in target;
+static char request[512];
+static size_t request_length;
+static atomic_int stop;
+
+static long long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int parse_argument(const char *str, int *result) {
+    char *end;
+    const long value = strtol(str, &end, 10);
+    if (*str == '\0' || *end != '\0' || value <= 0 || value > 65535)
+        return -1;
+    *result = (int)value;
+    return 0;
+}
+
+static void record_latency(worker *w, const long long latency_us) {
+    if (w->latency_count == w->latency_capacity) {
+        const size_t capacity = w->latency_capacity ? w->latency_capacity * 2 : 4096;
+        long long *bigger = realloc(w->latencies_us, capacity * sizeof(long long));
+        if (bigger == NULL)
+            return;
+        w->latencies_us = bigger;
+        w->latency_capacity = capacity;
+    }
+    w->latencies_us[w->latency_count++] = latency_us;
+}
+
+// One request on a fresh connection. Returns the response size, or -1
+static ssize_t run_request(char *buffer) {
+    const int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&target, sizeof(target)) != 0 ||
+        write(fd, request, request_length) != (ssize_t)request_length) {
+        close(fd);
+        return -1;
+    }
+
+    // The body is discarded, only the status line has to stay at the front
+    ssize_t total = 0, n;
+    while ((n = read(fd, buffer + (total < 16 ? total : 16), RESPONSE_BUFFER_SIZE - 16)) > 0)
+        total += n;
+    close(fd);
+
+    // Only a 200 counts
+    if (n < 0 || total < 12 || strncmp(buffer, "HTTP/1.", 7) != 0 || strncmp(buffer + 9, "200", 3) != 0)
+        return -1;
+    return total;
+}
+
+static void *worker_main(void *arg) {
+    worker *w = arg;
+    char *buffer = malloc(RESPONSE_BUFFER_SIZE);
+    if (buffer == NULL)
+        return NULL;
+
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        const long long start = now_us();
+        const ssize_t size = run_request(buffer);
+        if (size < 0) {
+            w->failed++;
+            continue;
+        }
+        w->ok++;
+        w->bytes += size;
+        record_latency(w, now_us() - start);
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+static int compare_latency(const void *a, const void *b) {
+    const long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[]) {
+    int port, connections, seconds;
+    if (argc < 4 || argc > 5 || parse_argument(argv[1], &port) != 0 ||
+        parse_argument(argv[2], &connections) != 0 || connections > MAX_CONNECTIONS ||
+        parse_argument(argv[3], &seconds) != 0) {
+        printf("Usage: bench <port> <connections> <seconds> [path]\n");
+        return EXIT_FAILURE;
+    }
+
+    target.sin_family = AF_INET;
+    target.sin_port = htons(port);
+    target.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    request_length = snprintf(request, sizeof(request),
+                              "GET %s HTTP/1.1\r\nHost: 127.0.0.1:%d\r\nConnection: close\r\n\r\n",
+                              argc == 5 ? argv[4] : "/", port);
+    if (request_length >= sizeof(request)) {
+        printf("Path too long\n");
+        return EXIT_FAILURE;
+    }
+
+    worker *workers = calloc(connections, sizeof(worker));
+    if (workers == NULL) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    const long long start = now_us();
+    int started = 0;
+    for (; started < connections; started++) {
+        if (pthread_create(&workers[started].thread, NULL, worker_main, &workers[started]) != 0) {
+            perror("pthread_create");
+            break;
+        }
+    }
+    sleep(seconds);
+    atomic_store(&stop, 1);
+
+    unsigned long long ok = 0, failed = 0, bytes = 0;
+    size_t count = 0;
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        ok += workers[i].ok;
+        failed += workers[i].failed;
+        bytes += workers[i].bytes;
+        count += workers[i].latency_count;
+    }
+    const double elapsed = (now_us() - start) / 1e6;
+
+    // Merge the samples for exact percentiles
+    long long *latencies = malloc((count ? count : 1) * sizeof(long long));
+    size_t merged = 0;
+    for (int i = 0; i < started; i++) {
+        if (latencies != NULL && workers[i].latency_count > 0)
+            memcpy(latencies + merged, workers[i].latencies_us, workers[i].latency_count * sizeof(long long));
+        merged += workers[i].latency_count;
+        free(workers[i].latencies_us);
+    }
+    free(workers);
+
+    printf("requests %llu failed %llu in %.2f s\n", ok, failed, elapsed);
+    printf("requests/sec %.0f\n", ok / elapsed);
+    printf("transfer/sec %.2f MiB\n", bytes / elapsed / (1024 * 1024));
+    if (latencies != NULL && count > 0) {
+        qsort(latencies, count, sizeof(long long), compare_latency);
+        printf("latency p50 %.3f ms p99 %.3f ms max %.3f ms\n", latencies[count / 2] / 1e3,
+               latencies[count * 99 / 100] / 1e3, latencies[count - 1] / 1e3);
+    }
+    free(latencies);
+    return failed > 0 && ok == 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,36 @@
+#!/bin/sh
+# Compares requests/sec and resident memory of HTTPServer and the assembly
+# webserver on loopback port 8080. Run it from the directory holding
+# index.html, both servers serve that file.
+#
+# Usage: ./bench.sh [server] [webserver] [bench] [connections] [seconds]
+
+SERVER=${1:-./server}
+WEBSERVER=${2:-./webserver}
+BENCH=${3:-./bench}
+CONNECTIONS=${4:-64}
+SECONDS_PER_RUN=${5:-10}
+PORT=8080
+
+# Resident memory of a process and its children, in KiB
+rss() {
+    ps -o rss= -p "$1" --ppid "$1" | awk '{ sum += $1 } END { print sum }'
+}
+
+run() {
+    name=$1
+    shift
+    "$@" &
+    pid=$!
+    sleep 1
+    echo "== $name"
+    "$BENCH" "$PORT" "$CONNECTIONS" "$SECONDS_PER_RUN"
+    echo "rss $(rss "$pid") KiB"
+    kill "$pid"
+    wait "$pid" 2>/dev/null
+    # Let the kernel release the port
+    sleep 1
+}
+
+run HTTPServer "$SERVER" "$PORT" "$(nproc)" 200 0
+run webserver "$WEBSERVER"
@@ -3,9 +3,12 @@
 #include <ctype.h>
 #include <string.h>
 #include <stdbool.h>
-#include <netinet/in.h>
-#include <netdb.h>
 #include <unistd.h>
+#include "http_parser.h"
+#include "resolver.h"
+#include "http_cache.h"
+#include "download.h"
+#include "url.h"
 
 // ----- DEBUG -----
 // Uncomment the following for debugging
@@ -18,24 +21,20 @@
 #define INVALID_FORMAT 1
 #define MEMORY_ERROR 2
 
-// Struct for representing a parsed URL
-typedef struct URL {
-    char *domain;  // Domain name
-    int port;      // Port number
-    char *path;    // Path in the URL
-} URL;
-
 // Function Prototypes
-int send_http_request(URL url, char *query_string);
-unsigned char *read_http_response(int sock);
+int send_http_request(URL url, char *query_string, const char *extra_headers);
+unsigned char *read_http_response(int sock, size_t *length);
 int parse_console(int argc, char *argv[], URL *url, char **query_string);
-char *strcasestr_custom(const char *haystack, const char *needle);
+int extract_output_option(int *argc, char *argv[], char **output_path);
+int download(URL url, const char *query_string, const char *output_path, char **temp_location);
 void print_usage();
 bool isInteger(const char *str, int *result);
 int build_query_string(char *argv[], int n, int index, char **result);
-int validate_and_parse_url(char *url, URL *url_struct);
 void free_pointers(unsigned char **response, char **query_string, char **location);
-int check_redirection(unsigned char *response, char **result);
+int check_redirection(const http_response *response, char **result);
+int follow_location(const char *location, URL *url, char **storage);
+int build_url_key(URL url, const char *query_string, char *buf, size_t size);
+void print_response(const unsigned char *response, size_t length, const char *source);
 
 int main(int argc, char *argv[]) {
 #ifdef DEBUG
@@ -47,6 +46,13 @@ int main(int argc, char *argv[]) {
     int status;
     URL url = {};
     char *query_string = "";
+    char *output_path = NULL;
+
+    // Take out "-o <file>", the rest is parsed positionally
+    if (extract_output_option(&argc, argv, &output_path) != SUCCESS) {
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
 
     // Parse console input and initialize URL and query string
     status = parse_console(argc, argv, &url, &query_string);
@@ -55,50 +61,99 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
+    // Large-download mode streams the body into the file instead of memory
+    if (output_path != NULL) {
+        char *temp_location = NULL;
+        status = download(url, query_string, output_path, &temp_location);
+        free_pointers(NULL, &query_string, NULL);
+        free(temp_location);
+        return status == SUCCESS ? 0 : EXIT_FAILURE;
+    }
+
     unsigned char *response = NULL;
+    size_t response_len = 0;
+    http_response parsed;
     int sockfd;
     char *location = NULL;
     char *temp_location = NULL;
+    char url_key[CACHE_MAX_URL];
+    char conditional[1024];
+    cache_entry cached;
 
     while (true) {
+        // Consult the response cache before touching the network
+        const bool use_cache = cache_enabled() && build_url_key(url, query_string, url_key, sizeof(url_key)) == 0;
+        int cache_state = use_cache ? cache_lookup(url_key, &cached) : CACHE_MISS;
+        conditional[0] = '\0';
+        if (cache_state == CACHE_FRESH) {
+            print_response(cached.response, cached.response_len, "cached");
+            cache_release(&cached);
+            break;
+        } else if (cache_state == CACHE_MOVED) {
+            // Memoized permanent redirect, skip the extra hop
+            status = follow_location(cached.meta->location, &url, &temp_location);
+            cache_release(&cached);
+            if (status != SUCCESS) {
+                free_pointers(&response, &query_string, &location);
+                exit(EXIT_FAILURE);
+            }
+            free_pointers(NULL, &query_string, NULL);
+            query_string = "";
+            continue;
+        } else if (cache_state == CACHE_STALE) {
+            cache_conditional_headers(&cached, conditional, sizeof(conditional));
+        }
+
         // Send HTTP request
-        sockfd = send_http_request(url, query_string);
+        sockfd = send_http_request(url, query_string, conditional);
         if (sockfd < 0) {
             free_pointers(&response, &query_string, &location);
             exit(EXIT_FAILURE);
         }
 
         // Read HTTP response
-        response = read_http_response(sockfd);
+        response = read_http_response(sockfd, &response_len);
         if (response == NULL) {
             free_pointers(&response, &query_string, &location);
             exit(EXIT_FAILURE);
         }
 
-        // Handle potential redirection
-        if (temp_location) {
-            free(temp_location);
-            temp_location = NULL;
+        // Index the status line and headers once
+        if (parse_http_response(response, response_len, &parsed) != 0) {
+            fprintf(stderr, "Malformed HTTP response\n");
+            free_pointers(&response, &query_string, &location);
+            exit(EXIT_FAILURE);
+        }
+
+        // Revalidated, the cached copy is still good
+        if (cache_state == CACHE_STALE && parsed.status_code == 304) {
+            cache_refresh(&cached, &parsed);
+            print_response(cached.response, cached.response_len, "cached");
+            cache_release(&cached);
+            break;
         }
-        status = check_redirection(response, &location);
+        if (cache_state != CACHE_MISS)
+            cache_release(&cached);
+
+        print_response(response, response_len, "received");
+        if (use_cache)
+            cache_store(url_key, response, response_len, &parsed);
+
+        // Handle potential redirection
+        status = check_redirection(&parsed, &location);
         if (status == MEMORY_ERROR) {
             free_pointers(&response, &query_string, &location);
             exit(EXIT_FAILURE);
         } else if (status == SUCCESS) {
+            if (use_cache && parsed.status_code == 301)
+                cache_store_redirect(url_key, location);
+
             // Process redirection
-            temp_location = realloc(temp_location, strlen(location) + 1);
-            if (temp_location == NULL) {
-                free(temp_location);
+            status = follow_location(location, &url, &temp_location);
+            if (status != SUCCESS) {
                 free_pointers(&response, &query_string, &location);
                 exit(EXIT_FAILURE);
             }
-            strcpy(temp_location, location);
-
-            // Update URL and query string
-            if (strncmp(temp_location, "http://", 7) == 0)
-                validate_and_parse_url(temp_location, &url);
-            else
-                url.path = temp_location[0] == '/' ? temp_location + 1 : temp_location;
 
             free_pointers(&response, &query_string, &location);
             query_string = "";
@@ -108,8 +163,8 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    close(sockfd);
     free_pointers(&response, &query_string, &location);
+    free(temp_location);
 
 #ifdef DEBUG
     restore_stdout(dup_stdout);
@@ -123,54 +178,27 @@ int main(int argc, char *argv[]) {
  *
  * @param url The URL structure containing domain, port, and path.
  * @param query_string The query string to append to the path.
+ * @param extra_headers Complete header lines to add to the request, may be empty.
  * @return Socket file descriptor on success, -1 on failure.
  */
-int send_http_request(URL url, char *query_string) {
+int send_http_request(URL url, char *query_string, const char *extra_headers) {
     // Calculate the size of the HTTP request string
-    int size = snprintf(NULL, 0, "GET /%s%s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n",
-                        url.path, query_string, url.domain);
+    int size = snprintf(NULL, 0, "GET /%s%s HTTP/1.1\r\nHost: %s\r\n%sConnection: close\r\n\r\n",
+                        url.path, query_string, url.domain, extra_headers);
     char *request = (char *)malloc(size + 1);
     if (!request) {
         perror("malloc");
         return -1;
     }
 
-    sprintf(request, "GET /%s%s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n",
-            url.path, query_string, url.domain);
+    sprintf(request, "GET /%s%s HTTP/1.1\r\nHost: %s\r\n%sConnection: close\r\n\r\n",
+            url.path, query_string, url.domain, extra_headers);
 
     printf("HTTP request =\n%s\nLEN = %d\n", request, (int)strlen(request));
 
-    int sock;
-    struct sockaddr_in server_addr;
-    struct hostent *server;
-
-    // Create socket
-    sock = socket(AF_INET, SOCK_STREAM, 0);
+    // Resolve hostname and connect to the server
+    int sock = connect_to_host(url.domain, url.port);
     if (sock < 0) {
-        perror("socket");
-        free(request);
-        return -1;
-    }
-
-    // Resolve hostname
-    server = gethostbyname(url.domain);
-    if (!server) {
-        herror("gethostbyname");
-        close(sock);
-        free(request);
-        return -1;
-    }
-
-    // Setup server socket structure
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(url.port);
-    server_addr.sin_addr.s_addr = ((struct in_addr *)server->h_addr_list[0])->s_addr;
-
-    // Connect to the server
-    if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("connect");
-        close(sock);
         free(request);
         return -1;
     }
@@ -197,9 +225,10 @@ int send_http_request(URL url, char *query_string) {
  * Reads the HTTP response from the socket.
  *
  * @param sock The socket file descriptor.
+ * @param length Pointer to store the number of bytes received.
  * @return Pointer to the response buffer, NULL on failure.
  */
-unsigned char *read_http_response(int sock) {
+unsigned char *read_http_response(int sock, size_t *length) {
     unsigned char *response = NULL;
     ssize_t total = 0, received = 0;
     unsigned char buffer[1024];
@@ -233,11 +262,8 @@ unsigned char *read_http_response(int sock) {
         response[total] = '\0';
     }
 
-    for (int i = 0; i < total; i++)
-        printf("%c", response[i]);
-    printf("\n Total received response bytes: %d\n", (int)total);
-
     close(sock);
+    *length = total;
     return response;
 }
 
@@ -307,59 +333,150 @@ int parse_console(int argc, char *argv[], URL *url, char **query_string) {
 }
 
 /**
- * Case-insensitive substring search.
+ * Removes "-o <file>" from the arguments, if present.
  *
- * @param haystack The string to search within.
- * @param needle The substring to search for.
- * @return Pointer to the start of the substring if found, NULL otherwise.
+ * @param argc Pointer to the number of arguments, updated.
+ * @param argv Argument array, compacted in place.
+ * @param output_path Pointer to store the output file, NULL if not given.
+ * @return SUCCESS on success, INVALID_FORMAT if -o has no file.
  */
-char *strcasestr_custom(const char *haystack, const char *needle) {
-    if (!*needle) return (char *)haystack;
+int extract_output_option(int *argc, char *argv[], char **output_path) {
+    for (int i = 1; i < *argc; i++) {
+        if (strcmp(argv[i], "-o") != 0)
+            continue;
+        if (i + 1 >= *argc)
+            return INVALID_FORMAT;
 
-    for (; *haystack; haystack++) {
-        const char *h = haystack;
-        const char *n = needle;
+        *output_path = argv[i + 1];
+        for (int j = i; j + 2 <= *argc; j++)
+            argv[j] = argv[j + 2];
+        *argc -= 2;
+        return SUCCESS;
+    }
+    return SUCCESS;
+}
 
-        while (*h && *n && tolower(*h) == tolower(*n)) {
-            h++;
-            n++;
+/**
+ * Downloads the URL into a file, following redirections.
+ *
+ * @param url The URL structure.
+ * @param query_string The query string to append to the path.
+ * @param output_path The file to write the body to.
+ * @param temp_location Pointer to the buffer holding a redirected URL.
+ * @return SUCCESS on success, 1 on failure.
+ */
+int download(URL url, const char *query_string, const char *output_path, char **temp_location) {
+    while (true) {
+        int size = snprintf(NULL, 0, "%s%s", url.path, query_string);
+        char *target = (char *)malloc(size + 1);
+        if (target == NULL) {
+            perror("malloc");
+            return MEMORY_ERROR;
         }
-        if (!*n) return (char *)haystack;
+        sprintf(target, "%s%s", url.path, query_string);
+
+        char *location = NULL;
+        int status = download_to_file(url.domain, url.port, target, output_path, &location);
+        free(target);
+        if (status != DOWNLOAD_REDIRECT)
+            return status == DOWNLOAD_OK ? SUCCESS : 1;
+
+        printf("Redirected to %s\n", location);
+        status = follow_location(location, &url, temp_location);
+        free(location);
+        if (status != SUCCESS)
+            return status;
+        query_string = "";
     }
-
-    return NULL;
 }
 
 /**
  * Checks if the response indicates a redirection and extracts the location.
  *
- * @param response The HTTP response buffer.
+ * @param response The parsed HTTP response.
  * @param result Pointer to store the redirection location, if any.
  * @return SUCCESS if redirection found, 1 if not, MEMORY_ERROR on allocation failure.
  */
-int check_redirection(unsigned char *response, char **result) {
-    if (strncmp((const char *)response, "HTTP/1.1 3", 10) == 0) {
-        char *loc_start = strcasestr_custom((const char *)response, "location:");
-        if (loc_start) {
-            loc_start += 9; // Skip "location:"
-            while (isspace((unsigned char)*loc_start)) loc_start++; // Skip leading whitespaces
-
-            const char *loc_end = loc_start;
-            while (*loc_end && *loc_end != '\r' && *loc_end != '\n') loc_end++; // Find end of the line
-
-            size_t loc_length = loc_end - loc_start;
-            *result = (char *)malloc(loc_length + 1);
-            if (*result == NULL) {
-                return MEMORY_ERROR;
-            }
+int check_redirection(const http_response *response, char **result) {
+    if (response->status_code < 300 || response->status_code > 399)
+        return 1; // Not a redirection status code
 
-            strncpy(*result, loc_start, loc_length);
-            (*result)[loc_length] = '\0';
-            return SUCCESS;
-        }
+    const header_t *location = get_header(response, HDR_LOCATION);
+    if (location == NULL || location->value_len == 0)
         return 1; // No "location" header found
+
+    *result = (char *)malloc(location->value_len + 1);
+    if (*result == NULL) {
+        return MEMORY_ERROR;
+    }
+
+    memcpy(*result, location->value, location->value_len);
+    (*result)[location->value_len] = '\0';
+    return SUCCESS;
+}
+
+/**
+ * Points the URL at a redirection target. Relative locations are resolved
+ * against the current URL, so the result never refers to the old storage.
+ *
+ * @param location The Location header value.
+ * @param url Pointer to the URL structure to update.
+ * @param storage Pointer to the buffer holding the current URL, replaced on success.
+ * @return SUCCESS on success, MEMORY_ERROR or INVALID_FORMAT on failure.
+ */
+int follow_location(const char *location, URL *url, char **storage) {
+    char *next;
+    if (strncmp(location, "http://", 7) == 0) {
+        next = strdup(location);
+    } else {
+        const char *path = location[0] == '/' ? location + 1 : location;
+        int size = snprintf(NULL, 0, "http://%s:%d/%s", url->domain, url->port, path);
+        next = (char *)malloc(size + 1);
+        if (next)
+            sprintf(next, "http://%s:%d/%s", url->domain, url->port, path);
+    }
+    if (next == NULL) {
+        perror("malloc");
+        return MEMORY_ERROR;
     }
-    return 1; // Not a redirection status code
+
+    URL target;
+    if (validate_and_parse_url(next, &target) != 0) {
+        fprintf(stderr, "Invalid redirection target: %s\n", location);
+        free(next);
+        return INVALID_FORMAT;
+    }
+
+    free(*storage);
+    *storage = next;
+    *url = target;
+    return SUCCESS;
+}
+
+/**
+ * Builds the cache key of a request, its full URL.
+ *
+ * @param url The URL structure.
+ * @param query_string The query string appended to the path.
+ * @param buf Buffer to store the key.
+ * @param size Size of the buffer.
+ * @return 0 on success, -1 if the key does not fit.
+ */
+int build_url_key(URL url, const char *query_string, char *buf, size_t size) {
+    int n = snprintf(buf, size, "http://%s:%d/%s%s", url.domain, url.port, url.path, query_string);
+    return n < 0 || (size_t)n >= size ? -1 : 0;
+}
+
+/**
+ * Prints a complete response, followed by its size.
+ *
+ * @param response The response bytes.
+ * @param length Number of bytes in the response.
+ * @param source Where the response came from, "received" or "cached".
+ */
+void print_response(const unsigned char *response, size_t length, const char *source) {
+    fwrite(response, 1, length, stdout);
+    printf("\n Total %s response bytes: %d\n", source, (int)length);
 }
 
 /**
@@ -390,69 +507,7 @@ void free_pointers(unsigned char **response, char **query_string, char **locatio
  * Prints usage instructions for the program.
  */
 void print_usage() {
-    printf("Usage: client [-r n <pr1=value1 pr2=value2 …>] <URL>\n");
-}
-
-/**
- * Validates and parses a URL into its components.
- *
- * @param url The input URL string.
- * @param url_struct Pointer to the URL structure to populate.
- * @return 0 on success, -1 on failure.
- */
-int validate_and_parse_url(char *url, URL *url_struct) {
-    url_struct->port = 80; // Default HTTP port
-
-    // Check if URL starts with "http://"
-    char *prefix = "http://";
-    if (strncmp(url, prefix, strlen(prefix)) != 0) {
-        return -1;
-    }
-
-    // Skip "http://"
-    char *domain_start = url + strlen(prefix);
-    char *p = domain_start;
-
-    // Extract domain
-    while (*p && *p != ':' && *p != '/' && *p != '\0') {
-        p++;
-    }
-    if (p == domain_start) {
-        return -1; // Empty domain
-    }
-
-    int domain_length = p - domain_start;
-
-    // Check for port
-    if (*p == ':') {
-        p++;
-        const char *port_start = p;
-
-        // Ensure port is numeric
-        while (isdigit(*p)) p++;
-
-        if (port_start == p || (*p != '/' && *p != '\0')) {
-            return -1;
-        }
-
-        int port = atoi(port_start);
-        if (port <= 0 || port >= 65536) {
-            return -1;
-        }
-        url_struct->port = port;
-    }
-
-    // Check for path
-    if (*p == '/') {
-        url_struct->path = p + 1;
-    } else {
-        url_struct->path = "";
-    }
-
-    url_struct->domain = domain_start;
-    url_struct->domain[domain_length] = '\0';
-
-    return 0;
+    printf("Usage: client [-o file] [-r n <pr1=value1 pr2=value2 …>] <URL>\n");
 }
 
 /**
@@ -0,0 +1,408 @@
+#define _GNU_SOURCE
+#include "dirlist.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+// Anything that changes what a listing shows
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_ATTRIB | \
+                    IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+// The kernel's record, glibc has no declaration for getdents64
+typedef struct linux_dirent64_st {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} linux_dirent64;
+
+typedef struct dir_entry_st {
+    const char *name;
+    size_t name_len;
+    int is_dir;
+    long long size;
+    time_t mtime;
+} dir_entry;
+
+// A cached directory. path is NULL if the slot is free
+typedef struct cache_slot_st {
+    char *path;
+    int wd;
+    unsigned long long generation;  //changes whenever the listings are dropped
+    dir_listing *listings[DIRLIST_FORMATS];
+} cache_slot;
+
+static const char *root_path;
+static int inotify_fd = -1;
+static cache_slot cache[DIRLIST_CACHE_SIZE];
+static int next_victim;
+static unsigned long long generations;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int dirlist_init(const char *root) {
+    root_path = root;
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    return inotify_fd;
+}
+
+void dirlist_release(dir_listing *listing) {
+    if (listing != NULL && atomic_fetch_sub(&listing->refs, 1) == 1)
+        free(listing);
+}
+
+// Listing under construction, grown geometrically
+typedef struct listing_buffer_st {
+    dir_listing *listing;
+    size_t capacity;
+    int failed;
+} listing_buffer;
+
+static void append(listing_buffer *buf, const char *data, const size_t len) {
+    if (buf->failed)
+        return;
+    if (buf->listing->length + len > buf->capacity) {
+        size_t capacity = buf->capacity * 2;
+        while (capacity < buf->listing->length + len)
+            capacity *= 2;
+        dir_listing *bigger = realloc(buf->listing, sizeof(dir_listing) + capacity);
+        if (bigger == NULL) {
+            buf->failed = 1;
+            return;
+        }
+        buf->listing = bigger;
+        buf->capacity = capacity;
+    }
+    memcpy(buf->listing->data + buf->listing->length, data, len);
+    buf->listing->length += len;
+}
+
+static void append_str(listing_buffer *buf, const char *str) {
+    append(buf, str, strlen(str));
+}
+
+static void append_html(listing_buffer *buf, const char *str, const size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        switch (str[i]) {
+            case '&': append_str(buf, "&amp;"); break;
+            case '<': append_str(buf, "&lt;"); break;
+            case '>': append_str(buf, "&gt;"); break;
+            case '"': append_str(buf, "&quot;"); break;
+            case '\'': append_str(buf, "&#39;"); break;
+            default: append(buf, &str[i], 1);
+        }
+    }
+}
+
+// Percent-encodes everything but unreserved characters, for href values
+static void append_url(listing_buffer *buf, const char *str, const size_t len) {
+    static const char hex[] = "0123456789ABCDEF";
+    for (size_t i = 0; i < len; i++) {
+        const unsigned char c = str[i];
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+            c == '-' || c == '.' || c == '_' || c == '~') {
+            append(buf, &str[i], 1);
+        } else {
+            const char encoded[3] = {'%', hex[c >> 4], hex[c & 15]};
+            append(buf, encoded, 3);
+        }
+    }
+}
+
+static void append_json(listing_buffer *buf, const char *str, const size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        const unsigned char c = str[i];
+        if (c == '"' || c == '\\') {
+            const char escaped[2] = {'\\', c};
+            append(buf, escaped, 2);
+        } else if (c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            append_str(buf, escaped);
+        } else {
+            append(buf, &str[i], 1);
+        }
+    }
+}
+
+// Directories first, then by name
+static int compare_entries(const void *a, const void *b) {
+    const dir_entry *x = a, *y = b;
+    if (x->is_dir != y->is_dir)
+        return y->is_dir - x->is_dir;
+    return strcmp(x->name, y->name);
+}
+
+/**
+ * Reads every entry of the open directory "fd". Names are copied into
+ * "names", which the caller frees with the array.
+ */
+static dir_entry *scan_directory(const int fd, size_t *count, char **names) {
+    char *batch = malloc(DIRLIST_GETDENTS_SIZE);
+    size_t capacity = 1024, names_capacity = 64 * 1024, names_length = 0;
+    dir_entry *entries = malloc(capacity * sizeof(dir_entry));
+    *names = malloc(names_capacity);
+    *count = 0;
+    if (batch == NULL || entries == NULL || *names == NULL)
+        goto fail;
+
+    long n;
+    while ((n = syscall(SYS_getdents64, fd, batch, DIRLIST_GETDENTS_SIZE)) > 0) {
+        for (long offset = 0; offset < n;) {
+            const linux_dirent64 *d = (const linux_dirent64 *)(batch + offset);
+            offset += d->d_reclen;
+            const size_t len = strlen(d->d_name);
+            if (d->d_name[0] == '.' && (len == 1 || (len == 2 && d->d_name[1] == '.')))
+                continue;
+
+            if (*count == capacity) {
+                dir_entry *bigger = realloc(entries, capacity * 2 * sizeof(dir_entry));
+                if (bigger == NULL)
+                    goto fail;
+                entries = bigger;
+                capacity *= 2;
+            }
+            if (names_length + len + 1 > names_capacity) {
+                char *bigger = realloc(*names, names_capacity * 2 + len + 1);
+                if (bigger == NULL)
+                    goto fail;
+                *names = bigger;
+                names_capacity = names_capacity * 2 + len + 1;
+            }
+
+            // Names are offsets until the block stops moving
+            memcpy(*names + names_length, d->d_name, len + 1);
+            dir_entry *e = &entries[(*count)++];
+            e->name = (const char *)(uintptr_t)names_length;
+            e->name_len = len;
+            e->is_dir = d->d_type == DT_DIR;
+            e->size = -1;
+            e->mtime = 0;
+            names_length += len + 1;
+
+            // The link itself, its target may be outside the root and is not served
+            struct stat st;
+            if (fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+                e->is_dir = S_ISDIR(st.st_mode);
+                e->size = st.st_size;
+                e->mtime = st.st_mtime;
+            }
+        }
+    }
+    if (n < 0)
+        goto fail;
+
+    for (size_t i = 0; i < *count; i++)
+        entries[i].name = *names + (uintptr_t)entries[i].name;
+    free(batch);
+    return entries;
+
+fail:
+    free(batch);
+    free(entries);
+    free(*names);
+    *names = NULL;
+    return NULL;
+}
+
+static void render_html(listing_buffer *buf, const char *dir, const dir_entry *entries, const size_t count) {
+    const char *title = strcmp(dir, ".") == 0 ? "" : dir;
+    append_str(buf, "<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\"><title>Index of /");
+    append_html(buf, title, strlen(title));
+    append_str(buf, "</title></head>\n<body><h1>Index of /");
+    append_html(buf, title, strlen(title));
+    append_str(buf, "</h1>\n<table>\n<tr><td><a href=\"../\">../</a></td><td></td><td></td></tr>\n");
+
+    char line[96];
+    for (size_t i = 0; i < count; i++) {
+        const dir_entry *e = &entries[i];
+        append_str(buf, "<tr><td><a href=\"");
+        append_url(buf, e->name, e->name_len);
+        append_str(buf, e->is_dir ? "/\">" : "\">");
+        append_html(buf, e->name, e->name_len);
+        append_str(buf, e->is_dir ? "/</a></td>" : "</a></td>");
+
+        struct tm tm;
+        char date[32] = "";
+        if (e->mtime > 0)
+            strftime(date, sizeof(date), "%Y-%m-%d %H:%M", gmtime_r(&e->mtime, &tm));
+        if (e->is_dir || e->size < 0)
+            snprintf(line, sizeof(line), "<td>-</td><td>%s</td></tr>\n", date);
+        else
+            snprintf(line, sizeof(line), "<td>%lld</td><td>%s</td></tr>\n", e->size, date);
+        append_str(buf, line);
+    }
+    append_str(buf, "</table>\n</body></html>\n");
+}
+
+static void render_json(listing_buffer *buf, const dir_entry *entries, const size_t count) {
+    char fields[96];
+    append_str(buf, "[");
+    for (size_t i = 0; i < count; i++) {
+        const dir_entry *e = &entries[i];
+        append_str(buf, i == 0 ? "\n{\"name\":\"" : ",\n{\"name\":\"");
+        append_json(buf, e->name, e->name_len);
+        snprintf(fields, sizeof(fields), "\",\"type\":\"%s\",\"size\":%lld,\"mtime\":%lld}",
+                 e->is_dir ? "directory" : "file", e->is_dir || e->size < 0 ? 0 : e->size, (long long)e->mtime);
+        append_str(buf, fields);
+    }
+    append_str(buf, "\n]\n");
+}
+
+// Scans and renders a directory, with one reference for the caller
+static dir_listing *render(const char *full_path, const char *dir, const int format) {
+    const int fd = open(full_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    size_t count;
+    char *names;
+    dir_entry *entries = scan_directory(fd, &count, &names);
+    close(fd);
+    if (entries == NULL)
+        return NULL;
+    qsort(entries, count, sizeof(dir_entry), compare_entries);
+
+    listing_buffer buf = {malloc(sizeof(dir_listing) + 4096), 4096, 0};
+    if (buf.listing != NULL) {
+        atomic_init(&buf.listing->refs, 1);
+        buf.listing->length = 0;
+        if (format == DIRLIST_JSON)
+            render_json(&buf, entries, count);
+        else
+            render_html(&buf, dir, entries, count);
+    }
+    free(entries);
+    free(names);
+
+    if (buf.listing == NULL || buf.failed) {
+        free(buf.listing);
+        return NULL;
+    }
+    return buf.listing;
+}
+
+static void drop_listings(cache_slot *slot) {
+    for (int f = 0; f < DIRLIST_FORMATS; f++) {
+        dirlist_release(slot->listings[f]);
+        slot->listings[f] = NULL;
+    }
+    slot->generation = ++generations;
+}
+
+static void free_slot(cache_slot *slot) {
+    drop_listings(slot);
+    free(slot->path);
+    slot->path = NULL;
+    slot->wd = -1;
+}
+
+static cache_slot *find_slot(const char *dir) {
+    for (int i = 0; i < DIRLIST_CACHE_SIZE; i++) {
+        if (cache[i].path != NULL && strcmp(cache[i].path, dir) == 0)
+            return &cache[i];
+    }
+    return NULL;
+}
+
+// A free slot, or the oldest one evicted. Called with cache_lock held
+static cache_slot *claim_slot(const char *dir, const char *full_path) {
+    cache_slot *slot = NULL;
+    for (int i = 0; i < DIRLIST_CACHE_SIZE && slot == NULL; i++) {
+        if (cache[i].path == NULL)
+            slot = &cache[i];
+    }
+    if (slot == NULL) {
+        slot = &cache[next_victim];
+        next_victim = (next_victim + 1) % DIRLIST_CACHE_SIZE;
+
+        // Two paths to one directory share a watch, keep it while the other is cached
+        int shared = 0;
+        for (int i = 0; i < DIRLIST_CACHE_SIZE; i++)
+            shared |= &cache[i] != slot && cache[i].wd == slot->wd;
+        if (!shared)
+            inotify_rm_watch(inotify_fd, slot->wd);
+        free_slot(slot);
+    }
+
+    // Watch before the first scan, so a change during the scan is not missed
+    const int wd = inotify_add_watch(inotify_fd, full_path, WATCH_MASK);
+    slot->path = wd >= 0 ? strdup(dir) : NULL;
+    if (slot->path == NULL)
+        return NULL;
+    slot->wd = wd;
+    slot->generation = ++generations;
+    return slot;
+}
+
+dir_listing *dirlist_get(const char *dir, const int format) {
+    char full_path[PATH_MAX];
+    if (snprintf(full_path, sizeof(full_path), "%s/%s", root_path, dir) >= (int)sizeof(full_path))
+        return NULL;
+
+    pthread_mutex_lock(&cache_lock);
+    cache_slot *slot = find_slot(dir);
+    if (slot == NULL)
+        slot = claim_slot(dir, full_path);
+    if (slot == NULL) {
+        // Not cacheable (no watch), render for this request only
+        pthread_mutex_unlock(&cache_lock);
+        return render(full_path, dir, format);
+    }
+    dir_listing *listing = slot->listings[format];
+    if (listing != NULL) {
+        atomic_fetch_add(&listing->refs, 1);
+        pthread_mutex_unlock(&cache_lock);
+        return listing;
+    }
+    const unsigned long long generation = slot->generation;
+    pthread_mutex_unlock(&cache_lock);
+
+    // Scan without the lock, then keep the result only if nothing changed meanwhile
+    listing = render(full_path, dir, format);
+    if (listing == NULL)
+        return NULL;
+    pthread_mutex_lock(&cache_lock);
+    slot = find_slot(dir);
+    if (slot != NULL && slot->generation == generation && slot->listings[format] == NULL) {
+        atomic_fetch_add(&listing->refs, 1);
+        slot->listings[format] = listing;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return listing;
+}
+
+void dirlist_handle_events() {
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while ((n = read(inotify_fd, events, sizeof(events))) > 0) {
+        pthread_mutex_lock(&cache_lock);
+        for (char *p = events; p < events + n;) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + event->len;
+
+            for (int i = 0; i < DIRLIST_CACHE_SIZE; i++) {
+                cache_slot *slot = &cache[i];
+                if (slot->path == NULL)
+                    continue;
+                if (event->mask & IN_Q_OVERFLOW)
+                    drop_listings(slot);    // events were lost, trust nothing
+                else if (slot->wd == event->wd && (event->mask & IN_IGNORED))
+                    free_slot(slot);        // the watch is gone with its directory
+                else if (slot->wd == event->wd)
+                    drop_listings(slot);
+            }
+        }
+        pthread_mutex_unlock(&cache_lock);
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef DIRLIST_H
+#define DIRLIST_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+/**
+ * dirlist.h
+ *
+ * Directory listings for the static file server. A directory is read
+ * with getdents64 in large batches, its entries are sorted once and the
+ * listing is rendered as HTML or JSON. Rendered listings are cached per
+ * directory; each cached directory has an inotify watch, and any change
+ * in it drops its listings, so hot directories are served from memory
+ * without rescanning.
+ */
+
+#define DIRLIST_CACHE_SIZE 256              //directories cached at once
+#define DIRLIST_GETDENTS_SIZE (1 << 20)     //bytes per getdents64 call
+
+#define DIRLIST_HTML 0
+#define DIRLIST_JSON 1
+#define DIRLIST_FORMATS 2
+
+/**
+ * A rendered listing. Shared between the cache and the requests writing
+ * it, freed by the last dirlist_release.
+ */
+typedef struct dir_listing_st {
+    atomic_int refs;
+    size_t length;
+    char data[];
+} dir_listing;
+
+/**
+ * dirlist_init sets the directory listings are relative to and creates
+ * the inotify instance. Returns its descriptor, to be polled by the
+ * caller, or -1 on failure.
+ */
+int dirlist_init(const char *root);
+
+/**
+ * dirlist_get returns the listing of "dir", a path relative to the root
+ * ("." for the root itself), in "format". Returns NULL if the directory
+ * cannot be read. Release the result with dirlist_release.
+ */
+dir_listing *dirlist_get(const char *dir, int format);
+
+/**
+ * dirlist_release drops a reference returned by dirlist_get.
+ */
+void dirlist_release(dir_listing *listing);
+
+/**
+ * dirlist_handle_events reads pending inotify events and drops the
+ * listings of every directory that changed. Call it when the inotify
+ * descriptor is readable.
+ */
+void dirlist_handle_events();
+
+#endif
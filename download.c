@@ -0,0 +1,397 @@
+#define _GNU_SOURCE
+#include "download.h"
+#include "http_parser.h"
+#include "resolver.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// One byte range fetched by one thread over its own connection
+typedef struct part_job_st {
+    const char *host;
+    int port;
+    const char *target;
+    int fd;
+    int journal_fd;
+    download_journal *journal;
+    int index;
+    int status;
+} part_job;
+
+static int write_all(int fd, const char *buf, size_t len) {
+    size_t total = 0;
+    while (total < len) {
+        const ssize_t n = write(fd, buf + total, len - total);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        total += n;
+    }
+    return 0;
+}
+
+static int pwrite_all(int fd, const unsigned char *buf, size_t len, unsigned long long offset) {
+    size_t total = 0;
+    while (total < len) {
+        const ssize_t n = pwrite(fd, buf + total, len - total, offset + total);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        total += n;
+    }
+    return 0;
+}
+
+/**
+ * Connects, sends the request and reads up to the end of the response head.
+ * Returns the socket, or -1 on failure. Body bytes read along with the head
+ * are left in "head" after parsed->head_len.
+ */
+static int open_request(const char *host, int port, const char *method, const char *target,
+                        const char *extra_headers, unsigned char *head, size_t *head_len,
+                        http_response *parsed) {
+    char request[2048];
+    const int len = snprintf(request, sizeof(request),
+                             "%s /%s HTTP/1.1\r\nHost: %s\r\n%sConnection: close\r\n\r\n",
+                             method, target, host, extra_headers);
+    if (len < 0 || (size_t)len >= sizeof(request)) {
+        fprintf(stderr, "Request too long\n");
+        return -1;
+    }
+
+    const int sock = connect_to_host(host, port);
+    if (sock < 0)
+        return -1;
+
+    if (write_all(sock, request, len) != 0) {
+        perror("write");
+        close(sock);
+        return -1;
+    }
+
+    *head_len = 0;
+    while (*head_len < DOWNLOAD_HEAD_SIZE) {
+        const ssize_t n = read(sock, head + *head_len, DOWNLOAD_HEAD_SIZE - *head_len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        *head_len += n;
+
+        const int rc = parse_http_response(head, *head_len, parsed);
+        if (rc == 0)
+            return sock;
+        if (rc < 0)
+            break;
+    }
+
+    fprintf(stderr, "Malformed HTTP response\n");
+    close(sock);
+    return -1;
+}
+
+/**
+ * Copies the body from "sock" into "fd" starting at offset *done, until "end"
+ * (exclusive, 0 to read until the peer closes). "done" is advanced and, if
+ * a journal is given, persisted after every write.
+ */
+static int stream_body(int sock, int fd, const unsigned char *leftover, size_t leftover_len,
+                       unsigned long long end, unsigned long long *done,
+                       int journal_fd, off_t journal_offset) {
+    unsigned char *buffer = malloc(DOWNLOAD_BUFFER_SIZE);
+    if (buffer == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    const unsigned char *data = leftover;
+    ssize_t n = (ssize_t)leftover_len;
+    int status = 0;
+    while (true) {
+        if (end && *done + n > end)
+            n = end - *done;
+        if (n > 0) {
+            // Data first, then the journal, so the journal never runs ahead
+            if (pwrite_all(fd, data, n, *done) != 0) {
+                perror("pwrite");
+                status = -1;
+                break;
+            }
+            *done += n;
+            if (journal_fd >= 0)
+                pwrite(journal_fd, done, sizeof(*done), journal_offset);
+        }
+        if (end && *done >= end)
+            break;
+
+        n = read(sock, buffer, DOWNLOAD_BUFFER_SIZE);
+        if (n < 0 && errno == EINTR) {
+            n = 0;
+            continue;
+        }
+        if (n < 0) {
+            perror("read");
+            status = -1;
+            break;
+        }
+        if (n == 0) {
+            // Closed before the range was complete
+            if (end)
+                status = -1;
+            break;
+        }
+        data = buffer;
+    }
+
+    free(buffer);
+    return status;
+}
+
+static void *fetch_part(void *arg) {
+    part_job *job = (part_job *)arg;
+    download_journal *journal = job->journal;
+    const int i = job->index;
+    job->status = -1;
+
+    if (journal->done[i] >= journal->end[i]) {
+        job->status = 0;
+        return NULL;
+    }
+
+    char extra[512];
+    snprintf(extra, sizeof(extra), "Range: bytes=%llu-%llu\r\nIf-Range: %s\r\n",
+             journal->done[i], journal->end[i] - 1, journal->validator);
+
+    unsigned char *head = malloc(DOWNLOAD_HEAD_SIZE);
+    if (head == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+
+    size_t head_len;
+    http_response parsed;
+    const int sock = open_request(job->host, job->port, "GET", job->target, extra, head, &head_len, &parsed);
+    if (sock < 0) {
+        free(head);
+        return NULL;
+    }
+
+    // Anything but a 206 for our offset means the body changed or ranges stopped working
+    const header_t *range = get_header(&parsed, HDR_CONTENT_RANGE);
+    if (parsed.status_code != 206 || range == NULL || range->value_len < 7 ||
+        strtoull(range->value + 6, NULL, 10) != journal->done[i]) {
+        fprintf(stderr, "Range %d: unexpected response (HTTP %d)\n", i, parsed.status_code);
+    } else {
+        const off_t journal_offset = offsetof(download_journal, done) + i * sizeof(journal->done[0]);
+        job->status = stream_body(sock, job->fd, parsed.body, parsed.body_len, journal->end[i],
+                                  &journal->done[i], job->journal_fd, journal_offset);
+    }
+
+    close(sock);
+    free(head);
+    return NULL;
+}
+
+// Reads a journal left by an interrupted run if it describes the same body
+static int load_journal(const char *journal_path, int fd, download_journal *journal) {
+    download_journal saved;
+    const int jfd = open(journal_path, O_RDONLY | O_CLOEXEC);
+    if (jfd < 0)
+        return -1;
+    const ssize_t n = read(jfd, &saved, sizeof(saved));
+    close(jfd);
+
+    struct stat st;
+    if (n != (ssize_t)sizeof(saved) || saved.magic != JOURNAL_MAGIC || saved.parts != DOWNLOAD_PARTS ||
+        saved.length != journal->length || strcmp(saved.validator, journal->validator) != 0 ||
+        fstat(fd, &st) != 0 || (unsigned long long)st.st_size != journal->length)
+        return -1;
+
+    *journal = saved;
+    return 0;
+}
+
+static int download_ranges(const char *host, int port, const char *target, const char *path,
+                           unsigned long long length, const char *validator) {
+    char journal_path[4096];
+    snprintf(journal_path, sizeof(journal_path), "%s%s", path, JOURNAL_SUFFIX);
+
+    const int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("open");
+        return DOWNLOAD_FAILED;
+    }
+
+    download_journal journal;
+    memset(&journal, 0, sizeof(journal));
+    journal.magic = JOURNAL_MAGIC;
+    journal.parts = DOWNLOAD_PARTS;
+    journal.length = length;
+    strcpy(journal.validator, validator);
+
+    if (load_journal(journal_path, fd, &journal) == 0) {
+        unsigned long long remaining = 0;
+        for (int i = 0; i < DOWNLOAD_PARTS; i++)
+            remaining += journal.end[i] - journal.done[i];
+        printf("Resuming %s: %llu of %llu bytes left\n", path, remaining, length);
+    } else {
+        // Fresh start: split evenly and reserve the whole file up front
+        const unsigned long long part = length / DOWNLOAD_PARTS;
+        for (int i = 0; i < DOWNLOAD_PARTS; i++) {
+            journal.start[i] = journal.done[i] = i * part;
+            journal.end[i] = i == DOWNLOAD_PARTS - 1 ? length : (i + 1) * part;
+        }
+        int rc = ftruncate(fd, 0) == 0 && fallocate(fd, 0, 0, length) == 0 ? 0 : errno;
+        if (rc == EOPNOTSUPP)
+            rc = ftruncate(fd, length) == 0 ? 0 : errno; // Not every filesystem can preallocate, a sparse file will do
+        if (rc != 0) {
+            errno = rc;
+            perror("fallocate");
+            close(fd);
+            return DOWNLOAD_FAILED;
+        }
+        printf("Downloading %llu bytes in %d ranges to %s\n", length, DOWNLOAD_PARTS, path);
+    }
+
+    const int journal_fd = open(journal_path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (journal_fd < 0 || pwrite(journal_fd, &journal, sizeof(journal), 0) != (ssize_t)sizeof(journal)) {
+        perror("journal");
+        if (journal_fd >= 0)
+            close(journal_fd);
+        close(fd);
+        return DOWNLOAD_FAILED;
+    }
+
+    part_job jobs[DOWNLOAD_PARTS];
+    pthread_t threads[DOWNLOAD_PARTS];
+    int started = 0;
+    for (int i = 0; i < DOWNLOAD_PARTS; i++) {
+        jobs[i] = (part_job){host, port, target, fd, journal_fd, &journal, i, -1};
+        if (pthread_create(&threads[i], NULL, fetch_part, &jobs[i]) != 0) {
+            perror("pthread_create");
+            break;
+        }
+        started++;
+    }
+
+    int status = started == DOWNLOAD_PARTS ? DOWNLOAD_OK : DOWNLOAD_FAILED;
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        if (jobs[i].status != 0)
+            status = DOWNLOAD_FAILED;
+    }
+
+    close(journal_fd);
+    if (close(fd) != 0)
+        status = DOWNLOAD_FAILED;
+
+    if (status == DOWNLOAD_OK) {
+        unlink(journal_path);
+        printf("Downloaded %llu bytes to %s\n", length, path);
+    } else {
+        fprintf(stderr, "Download interrupted, run again to resume from %s\n", journal_path);
+    }
+    return status;
+}
+
+// Fallback for servers without ranges or a known length
+static int download_single(const char *host, int port, const char *target, const char *path, char **location) {
+    unsigned char *head = malloc(DOWNLOAD_HEAD_SIZE);
+    if (head == NULL) {
+        perror("malloc");
+        return DOWNLOAD_FAILED;
+    }
+
+    size_t head_len;
+    http_response parsed;
+    const int sock = open_request(host, port, "GET", target, "", head, &head_len, &parsed);
+    if (sock < 0) {
+        free(head);
+        return DOWNLOAD_FAILED;
+    }
+
+    int status = DOWNLOAD_FAILED;
+    const header_t *redirect = get_header(&parsed, HDR_LOCATION);
+    if (parsed.status_code >= 300 && parsed.status_code <= 399 && redirect != NULL) {
+        *location = strndup(redirect->value, redirect->value_len);
+        status = *location ? DOWNLOAD_REDIRECT : DOWNLOAD_FAILED;
+    } else if (parsed.status_code != 200) {
+        fprintf(stderr, "HTTP %d\n", parsed.status_code);
+    } else {
+        const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            perror("open");
+        } else {
+            const header_t *cl = get_header(&parsed, HDR_CONTENT_LENGTH);
+            const unsigned long long end = cl ? strtoull(cl->value, NULL, 10) : 0;
+            unsigned long long done = 0;
+            if (stream_body(sock, fd, parsed.body, parsed.body_len, end, &done, -1, 0) == 0 && close(fd) == 0) {
+                printf("Downloaded %llu bytes to %s\n", done, path);
+                status = DOWNLOAD_OK;
+            }
+        }
+    }
+
+    close(sock);
+    free(head);
+    return status;
+}
+
+int download_to_file(const char *host, int port, const char *target, const char *path, char **location) {
+    unsigned char *head = malloc(DOWNLOAD_HEAD_SIZE);
+    if (head == NULL) {
+        perror("malloc");
+        return DOWNLOAD_FAILED;
+    }
+
+    // Probe the length and range support without fetching the body
+    size_t head_len;
+    http_response parsed;
+    const int sock = open_request(host, port, "HEAD", target, "", head, &head_len, &parsed);
+    if (sock < 0) {
+        free(head);
+        return DOWNLOAD_FAILED;
+    }
+    close(sock);
+
+    const header_t *redirect = get_header(&parsed, HDR_LOCATION);
+    if (parsed.status_code >= 300 && parsed.status_code <= 399 && redirect != NULL) {
+        *location = strndup(redirect->value, redirect->value_len);
+        free(head);
+        return *location ? DOWNLOAD_REDIRECT : DOWNLOAD_FAILED;
+    }
+
+    const header_t *cl = get_header(&parsed, HDR_CONTENT_LENGTH);
+    // If-Range needs a strong validator, a weak ETag would turn every range into a full 200
+    const header_t *validator = get_header(&parsed, HDR_ETAG);
+    if (validator != NULL && validator->value_len >= 2 && strncmp(validator->value, "W/", 2) == 0)
+        validator = NULL;
+    if (validator == NULL)
+        validator = get_header(&parsed, HDR_LAST_MODIFIED);
+    const unsigned long long length = cl ? strtoull(cl->value, NULL, 10) : 0;
+
+    // Ranges need a length, byte ranges, and a validator so parts of two versions never mix
+    if (parsed.status_code == 200 && length >= DOWNLOAD_MIN_PARALLEL &&
+        header_value_equals(get_header(&parsed, HDR_ACCEPT_RANGES), "bytes") &&
+        validator != NULL && validator->value_len < sizeof(((download_journal *)0)->validator)) {
+        char tag[256];
+        memcpy(tag, validator->value, validator->value_len);
+        tag[validator->value_len] = '\0';
+        free(head);
+        return download_ranges(host, port, target, path, length, tag);
+    }
+
+    free(head);
+    return download_single(host, port, target, path, location);
+}
@@ -0,0 +1,51 @@
+#ifndef DOWNLOAD_H
+#define DOWNLOAD_H
+
+#include <stddef.h>
+
+/**
+ * download.h
+ *
+ * Large-download mode of the client (-o file). The body is written
+ * straight to the output file instead of being collected in memory.
+ * When the server reports a Content-Length and Accept-Ranges: bytes,
+ * the file is preallocated and DOWNLOAD_PARTS byte ranges are fetched
+ * over parallel connections, each written at its offset with pwrite.
+ * Progress is kept in a sidecar journal (<file>.part) so an interrupted
+ * download resumes where every range left off.
+ */
+
+#define DOWNLOAD_PARTS 4
+#define DOWNLOAD_MIN_PARALLEL (1 << 20)   //smaller bodies use a single stream
+#define DOWNLOAD_BUFFER_SIZE (256 * 1024)
+#define DOWNLOAD_HEAD_SIZE 16384
+#define JOURNAL_MAGIC 0x314c4e4a          // "JNL1"
+#define JOURNAL_SUFFIX ".part"
+
+// Return codes
+#define DOWNLOAD_OK 0
+#define DOWNLOAD_FAILED -1
+#define DOWNLOAD_REDIRECT 1
+
+/**
+ * The sidecar journal. Written once when the download starts, then only
+ * the "done" offsets are updated as data lands in the file.
+ */
+typedef struct download_journal_st {
+    unsigned int magic;
+    int parts;
+    unsigned long long length;
+    char validator[256];    //ETag or Last-Modified of the body being fetched
+    unsigned long long start[DOWNLOAD_PARTS];
+    unsigned long long end[DOWNLOAD_PARTS];     //exclusive
+    unsigned long long done[DOWNLOAD_PARTS];    //next offset to fetch
+} download_journal;
+
+/**
+ * download_to_file fetches http://host:port/target into "path".
+ * On DOWNLOAD_REDIRECT, "location" holds a malloc'd Location value
+ * for the caller to follow.
+ */
+int download_to_file(const char *host, int port, const char *target, const char *path, char **location);
+
+#endif
@@ -0,0 +1,234 @@
+#include "http_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Cache-Control directives we act on
+#define CC_NO_STORE 1
+#define CC_NO_CACHE 2
+
+static unsigned long long hash_url(const char *url) {
+    unsigned long long h = 0xcbf29ce484222325ULL;
+    for (; *url; url++) {
+        h ^= (unsigned char)*url;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static int cache_path(const char *url, char *path, size_t size) {
+    const char *dir = getenv(CACHE_DIR_ENV);
+    if (dir == NULL || strlen(url) >= CACHE_MAX_URL)
+        return -1;
+    const int n = snprintf(path, size, "%s/%016llx.cache", dir, hash_url(url));
+    return n < 0 || (size_t)n >= size ? -1 : 0;
+}
+
+// Parses Cache-Control into CC_* flags and max-age (-1 if absent)
+static int parse_cache_control(const http_response *parsed, long long *max_age) {
+    *max_age = -1;
+    const header_t *cc = get_header(parsed, HDR_CACHE_CONTROL);
+    if (cc == NULL)
+        return 0;
+
+    int flags = 0;
+    const char *p = cc->value;
+    const char *end = cc->value + cc->value_len;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == ',')) p++;
+        const char *token = p;
+        while (p < end && *p != ',') p++;
+        const size_t len = p - token;
+
+        if (len == 8 && strncasecmp(token, "no-store", 8) == 0)
+            flags |= CC_NO_STORE;
+        else if (len == 8 && strncasecmp(token, "no-cache", 8) == 0)
+            flags |= CC_NO_CACHE;
+        else if (len > 8 && strncasecmp(token, "max-age=", 8) == 0)
+            *max_age = strtoll(token + 8, NULL, 10);
+    }
+    return flags;
+}
+
+static void copy_value(char *dst, size_t size, const header_t *header) {
+    dst[0] = '\0';
+    if (header == NULL || header->value_len >= size)
+        return;
+    memcpy(dst, header->value, header->value_len);
+    dst[header->value_len] = '\0';
+}
+
+// Writes a complete cache file under a temporary name and renames it into place
+static int write_entry(const char *url, const cache_meta *meta, const unsigned char *response, size_t len) {
+    char path[4096], tmp_path[4200];
+    if (cache_path(url, path, sizeof(path)) != 0)
+        return -1;
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int)getpid());
+
+    const int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("open cache");
+        return -1;
+    }
+
+    int ok = pwrite(fd, meta, sizeof(cache_meta), 0) == (ssize_t)sizeof(cache_meta);
+    size_t written = 0;
+    while (ok && written < len) {
+        const ssize_t n = pwrite(fd, response + written, len - written, CACHE_DATA_OFFSET + written);
+        if (n <= 0)
+            ok = 0;
+        else
+            written += n;
+    }
+
+    if (close(fd) != 0 || !ok || rename(tmp_path, path) != 0) {
+        perror("write cache");
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+int cache_enabled() {
+    return getenv(CACHE_DIR_ENV) != NULL;
+}
+
+int cache_lookup(const char *url, cache_entry *entry) {
+    char path[4096];
+    memset(entry, 0, sizeof(cache_entry));
+    entry->fd = -1;
+    if (cache_path(url, path, sizeof(path)) != 0)
+        return CACHE_MISS;
+
+    const int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        return CACHE_MISS;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(cache_meta)) {
+        close(fd);
+        return CACHE_MISS;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return CACHE_MISS;
+    }
+
+    const cache_meta *meta = map;
+    if (meta->magic != CACHE_MAGIC || strncmp(meta->url, url, CACHE_MAX_URL) != 0 ||
+        (meta->kind == CACHE_RESPONSE &&
+         (unsigned long long)st.st_size < CACHE_DATA_OFFSET + meta->response_len)) {
+        munmap(map, st.st_size);
+        close(fd);
+        return CACHE_MISS;
+    }
+
+    entry->fd = fd;
+    entry->map = map;
+    entry->map_len = st.st_size;
+    entry->meta = meta;
+    if (meta->kind == CACHE_REDIRECT)
+        return CACHE_MOVED;
+
+    entry->response = (const unsigned char *)map + CACHE_DATA_OFFSET;
+    entry->response_len = meta->response_len;
+    if (meta->max_age > 0 && time(NULL) < meta->stored_at + meta->max_age)
+        return CACHE_FRESH;
+    return CACHE_STALE;
+}
+
+void cache_release(cache_entry *entry) {
+    if (entry->map != NULL)
+        munmap(entry->map, entry->map_len);
+    if (entry->fd >= 0)
+        close(entry->fd);
+    memset(entry, 0, sizeof(cache_entry));
+    entry->fd = -1;
+}
+
+int cache_conditional_headers(const cache_entry *entry, char *buf, size_t size) {
+    int n = 0;
+    buf[0] = '\0';
+    if (entry->meta->etag[0])
+        n += snprintf(buf + n, size - n, "If-None-Match: %s\r\n", entry->meta->etag);
+    if (entry->meta->last_modified[0] && (size_t)n < size)
+        n += snprintf(buf + n, size - n, "If-Modified-Since: %s\r\n", entry->meta->last_modified);
+    return (size_t)n < size ? n : 0;
+}
+
+int cache_store(const char *url, const unsigned char *response, size_t len, const http_response *parsed) {
+    if (parsed->status_code != 200 || strlen(url) >= CACHE_MAX_URL)
+        return 1;
+
+    long long max_age;
+    const int flags = parse_cache_control(parsed, &max_age);
+    if (flags & CC_NO_STORE)
+        return 1;
+
+    cache_meta *meta = calloc(1, sizeof(cache_meta));
+    if (meta == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    meta->magic = CACHE_MAGIC;
+    meta->kind = CACHE_RESPONSE;
+    meta->stored_at = time(NULL);
+    meta->max_age = (flags & CC_NO_CACHE) || max_age < 0 ? 0 : max_age;
+    meta->response_len = len;
+    strcpy(meta->url, url);
+    copy_value(meta->etag, sizeof(meta->etag), get_header(parsed, HDR_ETAG));
+    copy_value(meta->last_modified, sizeof(meta->last_modified), get_header(parsed, HDR_LAST_MODIFIED));
+
+    // Nothing to revalidate with and never fresh, not worth keeping
+    int status = 1;
+    if (meta->max_age > 0 || meta->etag[0] || meta->last_modified[0])
+        status = write_entry(url, meta, response, len);
+    free(meta);
+    return status;
+}
+
+void cache_refresh(cache_entry *entry, const http_response *not_modified) {
+    long long max_age;
+    const int flags = parse_cache_control(not_modified, &max_age);
+
+    cache_meta meta = *entry->meta;
+    meta.stored_at = time(NULL);
+    if (max_age >= 0 || (flags & CC_NO_CACHE))
+        meta.max_age = (flags & CC_NO_CACHE) || max_age < 0 ? 0 : max_age;
+
+    const header_t *etag = get_header(not_modified, HDR_ETAG);
+    if (etag != NULL)
+        copy_value(meta.etag, sizeof(meta.etag), etag);
+
+    // Only the metadata block changes, the mapped response stays valid
+    if (pwrite(entry->fd, &meta, sizeof(cache_meta), 0) != (ssize_t)sizeof(cache_meta))
+        perror("write cache");
+}
+
+int cache_store_redirect(const char *url, const char *location) {
+    if (strlen(url) >= CACHE_MAX_URL || strlen(location) >= CACHE_MAX_URL)
+        return 1;
+
+    cache_meta *meta = calloc(1, sizeof(cache_meta));
+    if (meta == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    meta->magic = CACHE_MAGIC;
+    meta->kind = CACHE_REDIRECT;
+    meta->stored_at = time(NULL);
+    strcpy(meta->url, url);
+    strcpy(meta->location, location);
+
+    const int status = write_entry(url, meta, NULL, 0);
+    free(meta);
+    return status;
+}
@@ -0,0 +1,99 @@
+#ifndef HTTP_CACHE_H
+#define HTTP_CACHE_H
+
+#include <stddef.h>
+#include "http_parser.h"
+
+/**
+ * http_cache.h
+ *
+ * Optional on-disk response cache for the client, enabled by pointing
+ * HTTP_CLIENT_CACHE_DIR at a directory. Every URL maps to one file: a
+ * fixed metadata block followed, at a page-aligned offset, by the raw
+ * response, so a hit is served straight from an mmap of the file.
+ */
+
+#define CACHE_DIR_ENV "HTTP_CLIENT_CACHE_DIR"
+#define CACHE_MAGIC 0x31435448  // "HTC1"
+#define CACHE_DATA_OFFSET 4096
+#define CACHE_MAX_URL 1024
+
+// Kinds of cache entries
+#define CACHE_RESPONSE 1
+#define CACHE_REDIRECT 2
+
+// Lookup results
+#define CACHE_MISS 0
+#define CACHE_FRESH 1   //serve without network I/O
+#define CACHE_STALE 2   //revalidate with cache_conditional_headers
+#define CACHE_MOVED 3   //memoized 301, follow entry.meta->location
+
+/**
+ * The metadata block at the start of every cache file.
+ */
+typedef struct cache_meta_st {
+    unsigned int magic;
+    unsigned int kind;
+    long long stored_at;            //time the response was stored or last revalidated
+    long long max_age;              //seconds the entry stays fresh, 0 to always revalidate
+    unsigned long long response_len;
+    char url[CACHE_MAX_URL];        //full key, guards against hash collisions
+    char etag[256];
+    char last_modified[64];
+    char location[CACHE_MAX_URL];
+} cache_meta;
+
+/**
+ * A looked up entry. The response is mapped, not copied.
+ */
+typedef struct cache_entry_st {
+    int fd;
+    void *map;
+    size_t map_len;
+    const cache_meta *meta;
+    const unsigned char *response;
+    size_t response_len;
+} cache_entry;
+
+/**
+ * cache_enabled returns 1 if HTTP_CLIENT_CACHE_DIR is set.
+ */
+int cache_enabled();
+
+/**
+ * cache_lookup maps the entry for "url" into "entry" and reports
+ * whether it is fresh, stale or a memoized redirect. Anything but
+ * CACHE_MISS must be released with cache_release.
+ */
+int cache_lookup(const char *url, cache_entry *entry);
+
+/**
+ * cache_release unmaps an entry returned by cache_lookup.
+ */
+void cache_release(cache_entry *entry);
+
+/**
+ * cache_conditional_headers writes If-None-Match / If-Modified-Since
+ * lines for "entry" into "buf". Returns the length written.
+ */
+int cache_conditional_headers(const cache_entry *entry, char *buf, size_t size);
+
+/**
+ * cache_store saves a 200 response for "url" if its Cache-Control
+ * allows it and it carries a validator or a max-age.
+ * Returns 0 if stored, 1 if not cacheable, -1 on error.
+ */
+int cache_store(const char *url, const unsigned char *response, size_t len, const http_response *parsed);
+
+/**
+ * cache_refresh restarts the freshness lifetime of "entry" after a 304,
+ * taking the new max-age from the 304 response.
+ */
+void cache_refresh(cache_entry *entry, const http_response *not_modified);
+
+/**
+ * cache_store_redirect memoizes a permanent redirect from "url" to "location".
+ */
+int cache_store_redirect(const char *url, const char *location);
+
+#endif
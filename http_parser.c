@@ -0,0 +1,150 @@
+#include "http_parser.h"
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+// Lowercase names of the headers in header_id, in the same order
+static const char *const known_names[HDR_KNOWN_COUNT] = {
+    [HDR_LOCATION]          = "location",
+    [HDR_CONTENT_LENGTH]    = "content-length",
+    [HDR_CONTENT_TYPE]      = "content-type",
+    [HDR_CONTENT_RANGE]     = "content-range",
+    [HDR_TRANSFER_ENCODING] = "transfer-encoding",
+    [HDR_CONNECTION]        = "connection",
+    [HDR_ACCEPT_RANGES]     = "accept-ranges",
+    [HDR_CACHE_CONTROL]     = "cache-control",
+    [HDR_ETAG]              = "etag",
+    [HDR_LAST_MODIFIED]     = "last-modified",
+    [HDR_DATE]              = "date",
+    [HDR_EXPIRES]           = "expires",
+};
+
+// Slot table for the known headers. The hashes are the 32-bit FNV-1a of the
+// lowercase names; the slot is (hash >> KNOWN_SHIFT) & (KNOWN_SLOTS - 1),
+// which is collision-free for this set. Re-derive both when adding a header.
+#define KNOWN_SLOTS 32
+#define KNOWN_SHIFT 9
+
+typedef struct {
+    unsigned int hash;
+    int id;
+} known_slot;
+
+static const known_slot known_table[KNOWN_SLOTS] = {
+    [20] = {0x0bf5a9a6, HDR_LOCATION},
+    [2]  = {0x4df9451d, HDR_CONTENT_LENGTH},
+    [4]  = {0xfcf70995, HDR_CONTENT_TYPE},
+    [29] = {0xd3ecfa4a, HDR_CONTENT_RANGE},
+    [26] = {0xddb4744c, HDR_TRANSFER_ENCODING},
+    [15] = {0x38b99ed9, HDR_CONNECTION},
+    [7]  = {0x6625cf66, HDR_ACCEPT_RANGES},
+    [18] = {0x50c8a4cd, HDR_CACHE_CONTROL},
+    [11] = {0x06c857c0, HDR_ETAG},
+    [13] = {0xc0575a6b, HDR_LAST_MODIFIED},
+    [14] = {0xd472dc59, HDR_DATE},
+    [3]  = {0x3e8ec783, HDR_EXPIRES},
+};
+
+static unsigned int hash_name(const char *name, size_t len) {
+    unsigned int h = 0x811c9dc5;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)tolower((unsigned char)name[i]);
+        h *= 0x01000193;
+    }
+    return h;
+}
+
+static int known_header_id(const char *name, size_t len) {
+    const unsigned int h = hash_name(name, len);
+    const known_slot *slot = &known_table[(h >> KNOWN_SHIFT) & (KNOWN_SLOTS - 1)];
+    if (slot->hash != h)
+        return -1;
+
+    // Confirm, the hash alone is not proof
+    const char *known = known_names[slot->id];
+    if (strlen(known) != len || strncasecmp(known, name, len) != 0)
+        return -1;
+    return slot->id;
+}
+
+int parse_http_response(const unsigned char *buffer, size_t length, http_response *out) {
+    const char *p = (const char *)buffer;
+    const char *end = p + length;
+
+    memset(out, 0, sizeof(http_response));
+
+    // Status line: HTTP/1.x SSS reason
+    const char *eol = memchr(p, '\n', length);
+    if (eol == NULL)
+        return length < 12 || strncmp(p, "HTTP/1.", 7) == 0 ? 1 : -1;
+    if (eol - p < 12 || strncmp(p, "HTTP/1.", 7) != 0 || !isdigit((unsigned char)p[7]) || p[8] != ' ')
+        return -1;
+    if (!isdigit((unsigned char)p[9]) || !isdigit((unsigned char)p[10]) || !isdigit((unsigned char)p[11]))
+        return -1;
+    out->version_minor = p[7] - '0';
+    out->status_code = (p[9] - '0') * 100 + (p[10] - '0') * 10 + (p[11] - '0');
+    p = eol + 1;
+
+    // Header lines, up to the blank line
+    while (p < end) {
+        eol = memchr(p, '\n', end - p);
+        if (eol == NULL)
+            return 1;
+
+        const char *line_end = eol > p && eol[-1] == '\r' ? eol - 1 : eol;
+        if (line_end == p) {
+            out->head_len = eol + 1 - (const char *)buffer;
+            out->body = (const unsigned char *)eol + 1;
+            out->body_len = length - out->head_len;
+            return 0;
+        }
+
+        // Skip folded continuation lines and lines without a colon
+        const char *colon = memchr(p, ':', line_end - p);
+        if (*p == ' ' || *p == '\t' || colon == NULL || colon == p || out->header_count == MAX_HEADERS) {
+            out->skipped++;
+            p = eol + 1;
+            continue;
+        }
+
+        const char *value = colon + 1;
+        const char *value_end = line_end;
+        while (value < value_end && (*value == ' ' || *value == '\t')) value++;
+        while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) value_end--;
+
+        header_t *header = &out->headers[out->header_count++];
+        header->name = p;
+        header->name_len = colon - p;
+        header->value = value;
+        header->value_len = value_end - value;
+
+        // The first occurrence wins
+        const int id = known_header_id(header->name, header->name_len);
+        if (id >= 0 && out->known[id] == 0)
+            out->known[id] = out->header_count;
+
+        p = eol + 1;
+    }
+    return 1;
+}
+
+const header_t *get_header(const http_response *res, header_id id) {
+    if (id < 0 || id >= HDR_KNOWN_COUNT || res->known[id] == 0)
+        return NULL;
+    return &res->headers[res->known[id] - 1];
+}
+
+const header_t *find_header(const http_response *res, const char *name) {
+    const size_t len = strlen(name);
+    for (int i = 0; i < res->header_count; i++) {
+        const header_t *header = &res->headers[i];
+        if (header->name_len == len && strncasecmp(header->name, name, len) == 0)
+            return header;
+    }
+    return NULL;
+}
+
+int header_value_equals(const header_t *header, const char *value) {
+    const size_t len = strlen(value);
+    return header != NULL && header->value_len == len && strncasecmp(header->value, value, len) == 0;
+}
@@ -0,0 +1,87 @@
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+#include <stddef.h>
+
+/**
+ * http_parser.h
+ *
+ * Parses the status line and header block of an HTTP response once
+ * into an indexed table of (name, value) views into the original buffer.
+ * Scanning stops at the blank line, so the body is never touched.
+ */
+
+// maximum number of header lines kept per response
+#define MAX_HEADERS 64
+
+/**
+ * Headers recognized by the parser. Their position in the header
+ * table is recorded at parse time, so looking them up is O(1).
+ */
+typedef enum {
+    HDR_LOCATION,
+    HDR_CONTENT_LENGTH,
+    HDR_CONTENT_TYPE,
+    HDR_CONTENT_RANGE,
+    HDR_TRANSFER_ENCODING,
+    HDR_CONNECTION,
+    HDR_ACCEPT_RANGES,
+    HDR_CACHE_CONTROL,
+    HDR_ETAG,
+    HDR_LAST_MODIFIED,
+    HDR_DATE,
+    HDR_EXPIRES,
+    HDR_KNOWN_COUNT
+} header_id;
+
+/**
+ * A view into the response buffer. Not null-terminated.
+ */
+typedef struct header_st {
+    const char *name;
+    size_t name_len;
+    const char *value;   //value with surrounding whitespace trimmed
+    size_t value_len;
+} header_t;
+
+/**
+ * The parsed status line and header block.
+ */
+typedef struct http_response_st {
+    int version_minor;          //1 for HTTP/1.1, 0 for HTTP/1.0
+    int status_code;
+    size_t head_len;            //bytes up to and including the blank line
+    const unsigned char *body;  //first byte after the blank line
+    size_t body_len;
+    header_t headers[MAX_HEADERS];
+    int header_count;
+    int skipped;                //header lines not in headers: past MAX_HEADERS, folded or without a colon
+    int known[HDR_KNOWN_COUNT]; //index into headers + 1, 0 if absent
+} http_response;
+
+/**
+ * parse_http_response parses the status line and the header block of
+ * "buffer". Returns 0 on success, 1 if the header block is not complete
+ * yet (no blank line within "length" bytes), -1 on a malformed response.
+ */
+int parse_http_response(const unsigned char *buffer, size_t length, http_response *out);
+
+/**
+ * get_header returns the header with the given id, or NULL if the
+ * response did not carry it.
+ */
+const header_t *get_header(const http_response *res, header_id id);
+
+/**
+ * find_header looks up a header that is not in header_id by name,
+ * case-insensitively. Linear in the number of headers.
+ */
+const header_t *find_header(const http_response *res, const char *name);
+
+/**
+ * header_value_equals compares a header value case-insensitively
+ * with a null-terminated string.
+ */
+int header_value_equals(const header_t *header, const char *value);
+
+#endif
@@ -0,0 +1,206 @@
+#include "metrics.h"
+#include "access_log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+
+// Status codes with a series of their own, the rest are counted as "other"
+static const int tracked_status[] = {200, 206, 301, 304, 400, 404, 408, 411, 431, 500, 502, 503, 504};
+#define STATUS_SLOTS (sizeof(tracked_status) / sizeof(tracked_status[0]) + 1)
+
+// Upper bounds of the latency histogram buckets, in microseconds
+static const long long latency_bounds[] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000
+};
+#define LATENCY_BUCKETS (sizeof(latency_bounds) / sizeof(latency_bounds[0]) + 1)
+
+typedef _Atomic unsigned long long counter_t;
+
+// One per thread, aligned so two threads never write the same cache line
+typedef struct metrics_slot_st {
+    _Alignas(64) counter_t requests;
+    counter_t bytes_sent;
+    counter_t bytes_received;
+    counter_t connections_opened;
+    counter_t connections_closed;
+    counter_t connection_timeouts;
+    counter_t accept_queue_drops;
+    counter_t status[STATUS_SLOTS];
+    counter_t latency[LATENCY_BUCKETS];
+    counter_t latency_sum_us;
+} metrics_slot;
+
+static metrics_slot slots[METRICS_MAX_THREADS];
+static atomic_int slots_used;
+
+static _Thread_local metrics_slot *my_slot;
+static _Thread_local int my_slot_shared;
+
+static metrics_slot *slot() {
+    if (my_slot == NULL) {
+        const int index = atomic_fetch_add(&slots_used, 1);
+        // Threads beyond the limit share the last slot and pay for atomic adds
+        my_slot_shared = index >= METRICS_MAX_THREADS - 1;
+        my_slot = &slots[my_slot_shared ? METRICS_MAX_THREADS - 1 : index];
+    }
+    return my_slot;
+}
+
+// Single writer per slot: a relaxed load and store, no locked instruction
+static void add(counter_t *counter, unsigned long long n) {
+    if (my_slot_shared)
+        atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+    else
+        atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+                              memory_order_relaxed);
+}
+
+static unsigned long long total(size_t offset) {
+    unsigned long long sum = 0;
+    for (int i = 0; i < METRICS_MAX_THREADS; i++)
+        sum += atomic_load_explicit((counter_t *)((char *)&slots[i] + offset), memory_order_relaxed);
+    return sum;
+}
+
+#define TOTAL(field) total(offsetof(metrics_slot, field))
+
+void metrics_request_done(const int status_code, const size_t bytes_sent, const long long latency_us) {
+    metrics_slot *s = slot();
+    add(&s->requests, 1);
+    add(&s->bytes_sent, bytes_sent);
+
+    size_t status = STATUS_SLOTS - 1;
+    for (size_t i = 0; i < STATUS_SLOTS - 1; i++) {
+        if (tracked_status[i] == status_code) {
+            status = i;
+            break;
+        }
+    }
+    add(&s->status[status], 1);
+
+    size_t bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && latency_us > latency_bounds[bucket])
+        bucket++;
+    add(&s->latency[bucket], 1);
+    add(&s->latency_sum_us, latency_us > 0 ? latency_us : 0);
+}
+
+void metrics_bytes_received(const size_t bytes) {
+    add(&slot()->bytes_received, bytes);
+}
+
+void metrics_connection_opened() {
+    add(&slot()->connections_opened, 1);
+}
+
+void metrics_connection_closed() {
+    add(&slot()->connections_closed, 1);
+}
+
+void metrics_connection_timeout() {
+    add(&slot()->connection_timeouts, 1);
+}
+
+void metrics_accept_queue_drop() {
+    add(&slot()->accept_queue_drops, 1);
+}
+
+// Growing output buffer
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+    int failed;
+} text_buffer;
+
+static void append(text_buffer *buf, const char *format, ...) {
+    if (buf->failed)
+        return;
+
+    va_list args;
+    while (1) {
+        va_start(args, format);
+        const int n = vsnprintf(buf->data + buf->length, buf->capacity - buf->length, format, args);
+        va_end(args);
+        if (n < 0) {
+            buf->failed = 1;
+            return;
+        }
+        if ((size_t)n < buf->capacity - buf->length) {
+            buf->length += n;
+            return;
+        }
+
+        char *bigger = realloc(buf->data, buf->capacity * 2 + n);
+        if (bigger == NULL) {
+            buf->failed = 1;
+            return;
+        }
+        buf->data = bigger;
+        buf->capacity = buf->capacity * 2 + n;
+    }
+}
+
+static void counter(text_buffer *buf, const char *name, const char *help, unsigned long long value) {
+    append(buf, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help, name, name, value);
+}
+
+static void gauge(text_buffer *buf, const char *name, const char *help, long long value) {
+    append(buf, "# HELP %s %s\n# TYPE %s gauge\n%s %lld\n", name, help, name, name, value);
+}
+
+char *metrics_render(threadpool *pool, size_t *length) {
+    text_buffer buf = {malloc(4096), 0, 4096, 0};
+    if (buf.data == NULL)
+        return NULL;
+
+    counter(&buf, "http_requests_total", "Requests answered.", TOTAL(requests));
+    counter(&buf, "http_response_bytes_total", "Response bytes written, headers included.", TOTAL(bytes_sent));
+    counter(&buf, "http_request_bytes_total", "Request bytes read.", TOTAL(bytes_received));
+
+    append(&buf, "# HELP http_responses_total Responses by status code.\n# TYPE http_responses_total counter\n");
+    for (size_t i = 0; i < STATUS_SLOTS; i++) {
+        const unsigned long long value = total(offsetof(metrics_slot, status) + i * sizeof(counter_t));
+        if (i < STATUS_SLOTS - 1)
+            append(&buf, "http_responses_total{code=\"%d\"} %llu\n", tracked_status[i], value);
+        else
+            append(&buf, "http_responses_total{code=\"other\"} %llu\n", value);
+    }
+
+    const unsigned long long opened = TOTAL(connections_opened);
+    const unsigned long long closed = TOTAL(connections_closed);
+    counter(&buf, "http_connections_total", "Connections accepted.", opened);
+    gauge(&buf, "http_connections_active", "Connections currently open.", (long long)(opened - closed));
+    counter(&buf, "http_connection_timeouts_total", "Connections closed by a header, body or idle deadline.",
+            TOTAL(connection_timeouts));
+    counter(&buf, "http_accept_queue_drops_total", "Requests refused with 503 because the work queue was full.",
+            TOTAL(accept_queue_drops));
+    counter(&buf, "http_access_log_drops_total", "Access log records dropped because the writer fell behind.",
+            access_log_drops());
+
+    gauge(&buf, "threadpool_queue_depth", "Jobs waiting in the threadpool queue.", threadpool_queue_size(pool));
+    gauge(&buf, "threadpool_threads", "Worker threads.", pool->num_threads);
+
+    // Prometheus histograms are cumulative
+    append(&buf, "# HELP http_request_duration_seconds Time from the first request byte to the end of the response.\n"
+                 "# TYPE http_request_duration_seconds histogram\n");
+    unsigned long long cumulative = 0;
+    for (size_t i = 0; i < LATENCY_BUCKETS; i++) {
+        cumulative += total(offsetof(metrics_slot, latency) + i * sizeof(counter_t));
+        if (i < LATENCY_BUCKETS - 1)
+            append(&buf, "http_request_duration_seconds_bucket{le=\"%g\"} %llu\n",
+                   latency_bounds[i] / 1e6, cumulative);
+        else
+            append(&buf, "http_request_duration_seconds_bucket{le=\"+Inf\"} %llu\n", cumulative);
+    }
+    append(&buf, "http_request_duration_seconds_sum %.6f\n", TOTAL(latency_sum_us) / 1e6);
+    append(&buf, "http_request_duration_seconds_count %llu\n", cumulative);
+
+    if (buf.failed) {
+        free(buf.data);
+        return NULL;
+    }
+    *length = buf.length;
+    return buf.data;
+}
@@ -0,0 +1,45 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include "threadpool.h"
+
+/**
+ * metrics.h
+ *
+ * Server counters, exported in the Prometheus text format on METRICS_PATH.
+ * Every thread updates its own cache-line aligned slot with plain
+ * (relaxed) stores, so recording never contends. A scrape sums the slots.
+ */
+
+#define METRICS_PATH "/metrics"
+#define METRICS_MAX_THREADS (MAXT_IN_POOL + 8)
+#define METRICS_CONTENT_TYPE "text/plain; version=0.0.4"
+
+/**
+ * metrics_request_done records a finished request.
+ */
+void metrics_request_done(int status_code, size_t bytes_sent, long long latency_us);
+
+/**
+ * metrics_bytes_received counts request bytes read from clients.
+ */
+void metrics_bytes_received(size_t bytes);
+
+void metrics_connection_opened();
+void metrics_connection_closed();
+void metrics_connection_timeout();
+
+/**
+ * metrics_accept_queue_drop counts a request turned away because the
+ * threadpool queue was full.
+ */
+void metrics_accept_queue_drop();
+
+/**
+ * metrics_render writes the current values in the Prometheus text format
+ * into a malloc'd buffer. Returns NULL on allocation failure.
+ */
+char *metrics_render(threadpool *pool, size_t *length);
+
+#endif
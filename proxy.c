@@ -0,0 +1,586 @@
+#define _GNU_SOURCE
+#include "proxy.h"
+#include "url.h"
+#include "resolver.h"
+#include "http_parser.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define SPLICE_CHUNK 65536
+
+// Failures while talking to the upstream
+#define UPSTREAM_CLOSED -1      // nothing came back, a pooled connection may just have gone stale
+#define UPSTREAM_TIMEOUT -2
+#define UPSTREAM_ERROR -3
+
+// How the upstream delimits its response body
+#define BODY_NONE 0
+#define BODY_LENGTH 1
+#define BODY_CHUNKED 2
+#define BODY_UNTIL_CLOSE 3
+
+// Headers that describe one hop and are never forwarded
+static const char *hop_by_hop[] = {
+    "connection", "keep-alive", "proxy-connection", "te", "trailer", "transfer-encoding", "upgrade", "expect"
+};
+
+static proxy_route routes[PROXY_MAX_ROUTES];
+static int route_count;
+
+// Each worker splices through a pipe of its own, created on first use
+static _Thread_local int pipe_fds[2] = {-1, -1};
+
+// Buffered reads of the upstream response, for the parts that are parsed
+typedef struct upstream_reader_st {
+    int fd;
+    char *buf;
+    size_t start;
+    size_t end;
+    size_t capacity;
+} upstream_reader;
+
+int proxy_init(const char *spec, router *r, const dispatch_fn handler) {
+    char *copy = strdup(spec);
+    if (copy == NULL)
+        return -1;
+
+    char *save = NULL;
+    for (char *item = strtok_r(copy, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+        char *equals = strchr(item, '=');
+        URL url;
+        if (route_count == PROXY_MAX_ROUTES || item[0] != '/' || equals == NULL) {
+            fprintf(stderr, "proxy: invalid route \"%s\"\n", item);
+            return -1;
+        }
+        *equals = '\0';
+        if (validate_and_parse_url(equals + 1, &url) != 0) {
+            fprintf(stderr, "proxy: invalid upstream \"%s\"\n", equals + 1);
+            return -1;
+        }
+
+        // "/v1/" and "/v1" both become "/v1", the remainder of the request path starts with '/'
+        char *base = malloc(strlen(url.path) + 2);
+        if (base == NULL)
+            return -1;
+        base[0] = '/';
+        strcpy(base + 1, url.path);
+        size_t base_len = strlen(base);
+        while (base_len > 0 && base[base_len - 1] == '/')
+            base[--base_len] = '\0';
+
+        proxy_route *route = &routes[route_count++];
+        route->prefix = item;
+        route->prefix_len = strlen(item);
+        route->host = url.domain;
+        route->port = url.port;
+        route->base = base;
+        route->idle_count = 0;
+        pthread_mutex_init(&route->lock, NULL);
+        if (router_add_prefix(r, route->prefix, handler, route) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int wait_fd(const int fd, const short events) {
+    struct pollfd pfd = {.fd = fd, .events = events};
+    int ready;
+    while ((ready = poll(&pfd, 1, PROXY_TIMEOUT_MS)) < 0 && errno == EINTR) {
+    }
+    return ready > 0 ? 0 : -1;
+}
+
+// Works on the non-blocking client socket as well as the blocking upstream one
+static int write_all(const int fd, const char *buf, const size_t len, const int more) {
+    size_t total = 0;
+    while (total < len) {
+        const ssize_t n = send(fd, buf + total, len - total, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+        if (n < 0) {
+            if (errno == EINTR || (errno == EAGAIN && wait_fd(fd, POLLOUT) == 0))
+                continue;
+            return -1;
+        }
+        total += n;
+    }
+    return 0;
+}
+
+static int get_pipe() {
+    if (pipe_fds[0] < 0 && pipe2(pipe_fds, O_NONBLOCK | O_CLOEXEC) != 0) {
+        pipe_fds[0] = pipe_fds[1] = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// A failed splice may leave bytes in the pipe, start over with a new one
+static void discard_pipe() {
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    pipe_fds[0] = pipe_fds[1] = -1;
+}
+
+/**
+ * Moves "length" bytes, or everything up to end of file with
+ * "until_close", from one socket to the other through the pipe.
+ * Returns the number of bytes moved, or -1.
+ */
+static ssize_t splice_body(const int from, const int to, const size_t length, const int until_close) {
+    if (get_pipe() != 0)
+        return -1;
+
+    size_t moved = 0;
+    while (until_close || moved < length) {
+        const size_t want = until_close || length - moved > SPLICE_CHUNK ? SPLICE_CHUNK : length - moved;
+        const ssize_t in = splice(from, NULL, pipe_fds[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (in == 0) {
+            if (until_close)
+                break;
+            goto fail;
+        }
+        if (in < 0) {
+            if (errno == EINTR || (errno == EAGAIN && wait_fd(from, POLLIN) == 0))
+                continue;
+            goto fail;
+        }
+
+        // Empty the pipe before filling it again
+        const unsigned int more = !until_close && moved + in < length ? SPLICE_F_MORE : 0;
+        for (ssize_t left = in; left > 0;) {
+            const ssize_t out = splice(pipe_fds[0], NULL, to, NULL, left, SPLICE_F_MOVE | SPLICE_F_NONBLOCK | more);
+            if (out < 0) {
+                if (errno == EINTR || (errno == EAGAIN && wait_fd(to, POLLOUT) == 0))
+                    continue;
+                goto fail;
+            }
+            left -= out;
+        }
+        moved += in;
+    }
+    return (ssize_t)moved;
+
+fail:
+    discard_pipe();
+    return -1;
+}
+
+// A pooled connection that is still open, or a new one
+static int take_connection(proxy_route *route, int *reused) {
+    while (1) {
+        int fd = -1;
+        pthread_mutex_lock(&route->lock);
+        if (route->idle_count > 0)
+            fd = route->idle[--route->idle_count];
+        pthread_mutex_unlock(&route->lock);
+        if (fd < 0)
+            break;
+
+        // An idle upstream has nothing to say; data or EOF means it is done with us
+        char byte;
+        if (recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && errno == EAGAIN) {
+            *reused = 1;
+            return fd;
+        }
+        close(fd);
+    }
+
+    *reused = 0;
+    const int fd = connect_to_host(route->host, route->port);
+    if (fd < 0)
+        return -1;
+    const struct timeval timeout = {PROXY_TIMEOUT_MS / 1000, (PROXY_TIMEOUT_MS % 1000) * 1000};
+    const int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+static void put_connection(proxy_route *route, const int fd) {
+    pthread_mutex_lock(&route->lock);
+    if (route->idle_count < PROXY_POOL_SIZE) {
+        route->idle[route->idle_count++] = fd;
+        pthread_mutex_unlock(&route->lock);
+        return;
+    }
+    pthread_mutex_unlock(&route->lock);
+    close(fd);
+}
+
+void proxy_warm() {
+    for (int i = 0; i < route_count; i++) {
+        int reused;
+        const int fd = take_connection(&routes[i], &reused);
+        if (fd >= 0)
+            put_connection(&routes[i], fd);
+    }
+}
+
+static int is_hop_by_hop(const char *name, const size_t len) {
+    for (size_t i = 0; i < sizeof(hop_by_hop) / sizeof(hop_by_hop[0]); i++) {
+        if (strlen(hop_by_hop[i]) == len && strncasecmp(name, hop_by_hop[i], len) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+// 1 if "name" is one of the comma separated tokens of a Connection header value
+static int connection_lists(const char *value, const size_t value_len, const char *name, const size_t name_len) {
+    const char *p = value, *end = value + value_len;
+    while (p < end) {
+        const char *comma = memchr(p, ',', end - p);
+        const char *token_end = comma ? comma : end;
+        while (p < token_end && (*p == ' ' || *p == '\t')) p++;
+        const char *q = token_end;
+        while (q > p && (q[-1] == ' ' || q[-1] == '\t')) q--;
+        if ((size_t)(q - p) == name_len && strncasecmp(p, name, name_len) == 0)
+            return 1;
+        p = token_end + 1;
+    }
+    return 0;
+}
+
+// Headers the client named in its Connection header are for this hop only (RFC 9110 7.6.1)
+static int request_connection_lists(const proxy_request *req, const char *name, const size_t name_len) {
+    const char *end = req->head + req->head_len - 2;
+    const char *line = memmem(req->head, req->head_len, "\r\n", 2) + 2;
+    for (const char *eol; line < end; line = eol + 2) {
+        eol = memmem(line, end - line, "\r\n", 2);
+        if (eol - line > 11 && strncasecmp(line, "connection:", 11) == 0 &&
+            connection_lists(line + 11, eol - line - 11, name, name_len))
+            return 1;
+    }
+    return 0;
+}
+
+// Request line with the upstream path, the client's end-to-end headers and our Connection header
+static char *build_request_head(const proxy_route *route, const proxy_request *req, arena *a, size_t *length) {
+    const char *rest = req->path + route->prefix_len;
+    if (route->prefix[route->prefix_len - 1] == '/')
+        rest--;     // keep the '/' the prefix ended with
+    // "/api" and "/api?q" map to the base itself, "/v1" and "/v1?q", or to "/" when the base is empty
+    const int needs_slash = rest[0] != '/' && route->base[0] == '\0';
+
+    char *head = arena_alloc(a, req->head_len + strlen(route->base) + 64);
+    if (head == NULL)
+        return NULL;
+    char *p = head + sprintf(head, "%s %s%s%s HTTP/1.1\r\n", req->method, route->base, needs_slash ? "/" : "", rest);
+
+    const char *end = req->head + req->head_len - 2;
+    const char *line = memmem(req->head, req->head_len, "\r\n", 2) + 2;
+    while (line < end) {
+        const char *eol = memmem(line, end - line, "\r\n", 2);
+        const char *colon = memchr(line, ':', eol - line);
+        if (colon != NULL && !is_hop_by_hop(line, colon - line) && !request_connection_lists(req, line, colon - line)) {
+            memcpy(p, line, eol + 2 - line);
+            p += eol + 2 - line;
+        }
+        line = eol + 2;
+    }
+    p += sprintf(p, "Connection: keep-alive\r\n\r\n");
+    *length = p - head;
+    return head;
+}
+
+// The body is relayed as it is, chunked included, so its encoding header stays.
+// Hop-by-hop headers go, and so do those the upstream named in its Connection header
+static int keeps_header(const http_response *res, const header_t *h) {
+    const int encoding = h->name_len == 17 && strncasecmp(h->name, "transfer-encoding", 17) == 0;
+    if (encoding)
+        return 1;
+    if (is_hop_by_hop(h->name, h->name_len))
+        return 0;
+    for (int i = 0; i < res->header_count; i++) {
+        const header_t *c = &res->headers[i];
+        if (c->name_len == 10 && strncasecmp(c->name, "connection", 10) == 0 &&
+            connection_lists(c->value, c->value_len, h->name, h->name_len))
+            return 0;
+    }
+    return 1;
+}
+
+// The upstream status line and end-to-end headers, with our own Connection header
+static char *build_response_head(const http_response *res, const char *buf, const int keep_alive, arena *a,
+                                 size_t *length) {
+    static const char trailer[] = "Connection: keep-alive\r\n\r\n";   // the longer of the two
+    const char *status_end = memchr(buf, '\n', res->head_len) + 1;
+
+    // Headers are rewritten as "name: value\r\n", which can be longer than what the upstream sent
+    size_t size = (status_end - buf) + sizeof(trailer);
+    for (int i = 0; i < res->header_count; i++)
+        size += res->headers[i].name_len + res->headers[i].value_len + 4;
+    char *head = arena_alloc(a, size);
+    if (head == NULL)
+        return NULL;
+
+    memcpy(head, buf, status_end - buf);
+    char *p = head + (status_end - buf);
+    for (int i = 0; i < res->header_count; i++) {
+        const header_t *h = &res->headers[i];
+        if (!keeps_header(res, h))
+            continue;
+        memcpy(p, h->name, h->name_len);
+        p += h->name_len;
+        *p++ = ':';
+        *p++ = ' ';
+        memcpy(p, h->value, h->value_len);
+        p += h->value_len;
+        *p++ = '\r';
+        *p++ = '\n';
+    }
+    p += sprintf(p, "Connection: %s\r\n\r\n", keep_alive ? "keep-alive" : "close");
+    *length = p - head;
+    return head;
+}
+
+// Head, the body bytes already read, then the rest of the body straight from the client
+static int send_request(const int upstream, proxy_request *req, const char *head, const size_t head_len) {
+    const int has_body = req->body_len + req->body_remaining > 0;
+    if (write_all(upstream, head, head_len, has_body) != 0)
+        return UPSTREAM_CLOSED;
+    if (req->body_len > 0 && write_all(upstream, req->body, req->body_len, req->body_remaining > 0) != 0)
+        return UPSTREAM_ERROR;
+    if (req->body_remaining > 0) {
+        if (splice_body(req->client_fd, upstream, req->body_remaining, 0) < 0)
+            return UPSTREAM_ERROR;
+        req->body_remaining = 0;
+    }
+    return 0;
+}
+
+// Reads up to the end of the final (non 1xx) response head
+static int read_response_head(upstream_reader *r, http_response *res) {
+    while (1) {
+        if (r->end > 0) {
+            const int parsed = parse_http_response((const unsigned char *)r->buf, r->end, res);
+            // A head we cannot represent completely is never forwarded truncated, nor framed from a partial view
+            if (parsed < 0 || (parsed == 0 && res->skipped > 0))
+                return UPSTREAM_ERROR;
+            if (parsed == 0 && (res->status_code >= 200 || res->status_code < 100)) {
+                r->start = res->head_len;
+                return 0;
+            }
+            if (parsed == 0) {
+                // Interim response, the client asked for none of them
+                memmove(r->buf, r->buf + res->head_len, r->end - res->head_len);
+                r->end -= res->head_len;
+                continue;
+            }
+            if (r->end == r->capacity)
+                return UPSTREAM_ERROR;
+        }
+
+        const ssize_t n = recv(r->fd, r->buf + r->end, r->capacity - r->end, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return UPSTREAM_TIMEOUT;
+        if (n <= 0)
+            return r->end == 0 ? UPSTREAM_CLOSED : UPSTREAM_ERROR;
+        r->end += n;
+    }
+}
+
+// Relays one CRLF terminated line, e.g. a chunk size. Returns its start in the buffer or NULL
+static const char *relay_line(upstream_reader *r, const int client_fd, size_t *relayed) {
+    while (1) {
+        char *eol = memchr(r->buf + r->start, '\n', r->end - r->start);
+        if (eol != NULL) {
+            const char *line = r->buf + r->start;
+            const size_t len = eol + 1 - line;
+            if (write_all(client_fd, line, len, 1) != 0)
+                return NULL;
+            *relayed += len;
+            r->start += len;
+            return line;
+        }
+
+        // Keep the partial line at the front and read more
+        memmove(r->buf, r->buf + r->start, r->end - r->start);
+        r->end -= r->start;
+        r->start = 0;
+        if (r->end == r->capacity)
+            return NULL;
+        const ssize_t n = recv(r->fd, r->buf + r->end, r->capacity - r->end, 0);
+        if (n <= 0 && !(n < 0 && errno == EINTR))
+            return NULL;
+        if (n > 0)
+            r->end += n;
+    }
+}
+
+// Relays "length" body bytes, first from the buffer, then spliced
+static int relay_bytes(upstream_reader *r, const int client_fd, const size_t length, size_t *relayed) {
+    const size_t buffered = r->end - r->start < length ? r->end - r->start : length;
+    if (buffered > 0 && write_all(client_fd, r->buf + r->start, buffered, buffered < length) != 0)
+        return -1;
+    r->start += buffered;
+    *relayed += buffered;
+    if (buffered == length)
+        return 0;
+    if (splice_body(r->fd, client_fd, length - buffered, 0) < 0)
+        return -1;
+    *relayed += length - buffered;
+    return 0;
+}
+
+// Chunk sizes and trailers go through the buffer, chunk data is spliced
+static int relay_chunked(upstream_reader *r, const int client_fd, size_t *relayed) {
+    while (1) {
+        const char *line = relay_line(r, client_fd, relayed);
+        if (line == NULL)
+            return -1;
+        char *end;
+        const unsigned long long size = strtoull(line, &end, 16);
+        if (end == line)
+            return -1;
+        if (size == 0)
+            break;
+        if (relay_bytes(r, client_fd, size + 2, relayed) != 0)  // data and its CRLF
+            return -1;
+    }
+
+    // Trailers, up to the empty line
+    while (1) {
+        const char *line = relay_line(r, client_fd, relayed);
+        if (line == NULL)
+            return -1;
+        if (line[0] == '\r' || line[0] == '\n')
+            return 0;
+    }
+}
+
+static int body_mode(const http_response *res, const char *method, size_t *length) {
+    if (strcmp(method, "HEAD") == 0 || res->status_code == 204 || res->status_code == 304)
+        return BODY_NONE;
+
+    const header_t *te = get_header(res, HDR_TRANSFER_ENCODING);
+    if (te != NULL)
+        return header_value_equals(te, "chunked") ? BODY_CHUNKED : BODY_UNTIL_CLOSE;
+
+    const header_t *cl = get_header(res, HDR_CONTENT_LENGTH);
+    if (cl == NULL || cl->value_len == 0)
+        return BODY_UNTIL_CLOSE;
+    *length = 0;
+    for (size_t i = 0; i < cl->value_len; i++) {
+        if (cl->value[i] < '0' || cl->value[i] > '9')
+            return BODY_UNTIL_CLOSE;
+        *length = *length * 10 + (cl->value[i] - '0');
+    }
+    return BODY_LENGTH;
+}
+
+static int upstream_keeps_alive(const http_response *res) {
+    const header_t *connection = get_header(res, HDR_CONNECTION);
+    if (connection != NULL && header_value_equals(connection, "close"))
+        return 0;
+    return res->version_minor >= 1 || (connection != NULL && header_value_equals(connection, "keep-alive"));
+}
+
+static int send_proxy_error(proxy_request *req, const int status_code, size_t *bytes_sent) {
+    char response[128];
+    const int len = snprintf(response, sizeof(response),
+                             "HTTP/1.1 %d %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", status_code,
+                             status_code == 504 ? "Gateway Timeout" : "Bad Gateway");
+    req->keep_alive = 0;
+    if (write_all(req->client_fd, response, len, 0) == 0)
+        *bytes_sent = len;
+    return status_code;
+}
+
+// Whether the client waits for "100 Continue" before sending its body
+static int expects_continue(const proxy_request *req) {
+    const char *end = req->head + req->head_len;
+    for (const char *line = req->head; line != NULL && line < end;) {
+        if (strncasecmp(line, "expect:", 7) == 0)
+            return 1;
+        line = memmem(line, end - line, "\r\n", 2);
+        if (line != NULL)
+            line += 2;
+    }
+    return 0;
+}
+
+int proxy_forward(proxy_route *route, proxy_request *req, arena *a, size_t *bytes_sent) {
+    *bytes_sent = 0;
+    size_t request_len;
+    const char *request = build_request_head(route, req, a, &request_len);
+    if (request == NULL)
+        return send_proxy_error(req, 502, bytes_sent);
+
+    const int has_body = req->body_len + req->body_remaining > 0;
+    if (req->body_remaining > 0 && expects_continue(req))
+        write_all(req->client_fd, "HTTP/1.1 100 Continue\r\n\r\n", 25, 0);
+
+    char buf[PROXY_HEAD_SIZE];
+    upstream_reader reader = {-1, buf, 0, 0, sizeof(buf)};
+    http_response res;
+    while (1) {
+        int reused;
+        reader.fd = take_connection(route, &reused);
+        if (reader.fd < 0)
+            return send_proxy_error(req, 502, bytes_sent);
+
+        int rc = send_request(reader.fd, req, request, request_len);
+        if (rc == 0)
+            rc = read_response_head(&reader, &res);
+        if (rc == 0)
+            break;
+        close(reader.fd);
+
+        // A pooled connection the upstream closed meanwhile, try the next one; a new connection is never retried,
+        // so this ends after at most PROXY_POOL_SIZE stale connections
+        if (rc == UPSTREAM_CLOSED && reused && !has_body)
+            continue;
+        return send_proxy_error(req, rc == UPSTREAM_TIMEOUT ? 504 : 502, bytes_sent);
+    }
+
+    size_t length = 0;
+    const int mode = body_mode(&res, req->method, &length);
+    if (mode == BODY_UNTIL_CLOSE)
+        req->keep_alive = 0;
+
+    size_t head_len;
+    const char *head = build_response_head(&res, buf, req->keep_alive, a, &head_len);
+    if (head == NULL || write_all(req->client_fd, head, head_len, mode != BODY_NONE) != 0) {
+        close(reader.fd);
+        req->keep_alive = 0;
+        return res.status_code;
+    }
+    *bytes_sent = head_len;
+
+    int failed = 0;
+    size_t relayed = 0;
+    if (mode == BODY_LENGTH) {
+        failed = relay_bytes(&reader, req->client_fd, length, &relayed) != 0;
+    } else if (mode == BODY_CHUNKED) {
+        failed = relay_chunked(&reader, req->client_fd, &relayed) != 0;
+    } else if (mode == BODY_UNTIL_CLOSE) {
+        const size_t buffered = reader.end - reader.start;
+        failed = write_all(req->client_fd, buf + reader.start, buffered, 1) != 0;
+        const ssize_t spliced = failed ? -1 : splice_body(reader.fd, req->client_fd, 0, 1);
+        failed = spliced < 0;
+        relayed = failed ? 0 : buffered + spliced;
+    }
+    *bytes_sent += relayed;
+
+    // Reuse the upstream only if it sent exactly one complete response
+    if (!failed && mode != BODY_UNTIL_CLOSE && reader.start == reader.end && upstream_keeps_alive(&res))
+        put_connection(route, reader.fd);
+    else
+        close(reader.fd);
+    if (failed)
+        req->keep_alive = 0;
+    return res.status_code;
+}
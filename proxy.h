@@ -0,0 +1,79 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include "arena.h"
+#include "router.h"
+
+/**
+ * proxy.h
+ *
+ * Reverse-proxy mode. Requests whose path starts with a configured
+ * prefix are forwarded to an upstream server over a pool of keep-alive
+ * connections. Request and response bodies are moved between the
+ * sockets with splice through a pipe, so they never enter user space;
+ * only the heads are parsed and rewritten.
+ *
+ * Configured with HTTP_SERVER_PROXY, a comma separated list of
+ * prefix=url pairs, e.g. "/api=http://127.0.0.1:9000/v1,/img=http://img:80".
+ * "/api/users" is then forwarded to 127.0.0.1:9000 as "/v1/users".
+ */
+
+#define PROXY_ENV "HTTP_SERVER_PROXY"
+#define PROXY_MAX_ROUTES 32
+#define PROXY_POOL_SIZE 32          //idle upstream connections kept per route
+#define PROXY_HEAD_SIZE 8192        //largest upstream response head
+#define PROXY_TIMEOUT_MS 30000      //upstream and client inactivity limit
+
+/**
+ * A prefix and the upstream it maps to.
+ */
+typedef struct proxy_route_st {
+    const char *prefix;
+    size_t prefix_len;
+    const char *host;
+    int port;
+    const char *base;               //upstream path prefix, "" or "/v1"
+    pthread_mutex_t lock;
+    int idle[PROXY_POOL_SIZE];      //pooled upstream connections
+    int idle_count;
+} proxy_route;
+
+/**
+ * A client request, as far as the event loop has read it.
+ */
+typedef struct proxy_request_st {
+    int client_fd;
+    const char *method;
+    const char *path;
+    const char *head;           //raw request head, blank line included
+    size_t head_len;
+    const char *body;           //body bytes that arrived with the head
+    size_t body_len;
+    size_t body_remaining;      //body bytes still unread on client_fd
+    int keep_alive;             //in: the client asked for it, out: the connection can be reused
+} proxy_request;
+
+/**
+ * proxy_init parses a route list in the PROXY_ENV format and registers
+ * every prefix in "r" with "handler", the route as its data.
+ * Returns 0 on success, -1 if it is malformed.
+ */
+int proxy_init(const char *spec, router *r, dispatch_fn handler);
+
+/**
+ * proxy_warm opens one pooled connection to every upstream, resolving
+ * its host on the way, so the first proxied requests do not pay for it.
+ */
+void proxy_warm();
+
+/**
+ * proxy_forward sends "req" upstream and relays the response to the
+ * client. Headers are built in "a". Returns the status code sent to the
+ * client, 502 or 504 when the upstream failed, and stores the number of
+ * bytes written to the client in "bytes_sent".
+ */
+int proxy_forward(proxy_route *route, proxy_request *req, arena *a, size_t *bytes_sent);
+
+#endif
@@ -0,0 +1,322 @@
+#include "resolver.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+static dns_entry cache[DNS_CACHE_SIZE];
+static int cache_loaded = 0;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Reads the persisted cache, one "host port expires family address" per line
+static void load_cache() {
+    const char *path = getenv(DNS_CACHE_ENV);
+    if (path == NULL)
+        return;
+    FILE *fp = fopen(path, "re");
+    if (fp == NULL)
+        return;
+
+    char host[DNS_MAX_HOST], address[INET6_ADDRSTRLEN];
+    int port, family;
+    long long expires;
+    const time_t now = time(NULL);
+    while (fscanf(fp, "%255s %d %lld %d %45s", host, &port, &expires, &family, address) == 5) {
+        if (expires <= now)
+            continue;
+
+        // Find the entry for this host or the first free one
+        dns_entry *entry = NULL;
+        for (int i = 0; i < DNS_CACHE_SIZE && entry == NULL; i++) {
+            if (cache[i].count == 0 || (cache[i].port == port && strcmp(cache[i].host, host) == 0))
+                entry = &cache[i];
+        }
+        if (entry == NULL)
+            break;
+        if (entry->count == DNS_MAX_ADDRS)
+            continue;
+
+        struct sockaddr_storage *addr = &entry->addrs[entry->count];
+        memset(addr, 0, sizeof(*addr));
+        if (family == AF_INET6) {
+            struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)addr;
+            in6->sin6_family = AF_INET6;
+            in6->sin6_port = htons(port);
+            if (inet_pton(AF_INET6, address, &in6->sin6_addr) != 1)
+                continue;
+            entry->addr_lens[entry->count] = sizeof(struct sockaddr_in6);
+        } else {
+            struct sockaddr_in *in4 = (struct sockaddr_in *)addr;
+            in4->sin_family = AF_INET;
+            in4->sin_port = htons(port);
+            if (inet_pton(AF_INET, address, &in4->sin_addr) != 1)
+                continue;
+            entry->addr_lens[entry->count] = sizeof(struct sockaddr_in);
+        }
+        strcpy(entry->host, host);
+        entry->port = port;
+        entry->expires = (time_t)expires;
+        entry->count++;
+    }
+    fclose(fp);
+}
+
+static void save_cache() {
+    const char *path = getenv(DNS_CACHE_ENV);
+    if (path == NULL)
+        return;
+
+    // Write a temporary file and rename it, so concurrent runs never see half a file
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int)getpid());
+    FILE *fp = fopen(tmp_path, "we");
+    if (fp == NULL)
+        return;
+
+    const time_t now = time(NULL);
+    char address[INET6_ADDRSTRLEN];
+    for (int i = 0; i < DNS_CACHE_SIZE; i++) {
+        if (cache[i].count == 0 || cache[i].expires <= now)
+            continue;
+        for (int j = 0; j < cache[i].count; j++) {
+            const struct sockaddr_storage *addr = &cache[i].addrs[j];
+            const void *raw = addr->ss_family == AF_INET6
+                ? (const void *)&((const struct sockaddr_in6 *)addr)->sin6_addr
+                : (const void *)&((const struct sockaddr_in *)addr)->sin_addr;
+            inet_ntop(addr->ss_family, raw, address, sizeof(address));
+            fprintf(fp, "%s %d %lld %d %s\n", cache[i].host, cache[i].port,
+                    (long long)cache[i].expires, addr->ss_family, address);
+        }
+    }
+
+    if (fclose(fp) != 0 || rename(tmp_path, path) != 0)
+        unlink(tmp_path);
+}
+
+int resolve_host(const char *host, int port, dns_entry *out) {
+    if (strlen(host) >= DNS_MAX_HOST)
+        return -1;
+
+    pthread_mutex_lock(&cache_lock);
+    if (!cache_loaded) {
+        load_cache();
+        cache_loaded = 1;
+    }
+
+    const time_t now = time(NULL);
+    for (int i = 0; i < DNS_CACHE_SIZE; i++) {
+        if (cache[i].count > 0 && cache[i].expires > now &&
+            cache[i].port == port && strcmp(cache[i].host, host) == 0) {
+            *out = cache[i];
+            pthread_mutex_unlock(&cache_lock);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    // Resolve without holding the lock
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+
+    char service[8];
+    snprintf(service, sizeof(service), "%d", port);
+    const int rc = getaddrinfo(host, service, &hints, &res);
+    if (rc != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rc));
+        return -1;
+    }
+
+    // Split by family, keeping getaddrinfo's (RFC 6724) order within each
+    struct addrinfo *v6[DNS_MAX_ADDRS], *v4[DNS_MAX_ADDRS];
+    int n6 = 0, n4 = 0;
+    int first_family = 0;
+    for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+        if (ai->ai_family == AF_INET6 && n6 < DNS_MAX_ADDRS)
+            v6[n6++] = ai;
+        else if (ai->ai_family == AF_INET && n4 < DNS_MAX_ADDRS)
+            v4[n4++] = ai;
+        else
+            continue;
+        if (first_family == 0)
+            first_family = ai->ai_family;
+    }
+
+    // Interleave the families, starting with the preferred one (RFC 8305 section 4)
+    memset(out, 0, sizeof(dns_entry));
+    strcpy(out->host, host);
+    out->port = port;
+    out->expires = now + DNS_CACHE_TTL;
+    int i6 = 0, i4 = 0;
+    int take_v6 = first_family == AF_INET6;
+    while (out->count < DNS_MAX_ADDRS && (i6 < n6 || i4 < n4)) {
+        struct addrinfo *ai;
+        if ((take_v6 && i6 < n6) || i4 >= n4)
+            ai = v6[i6++];
+        else
+            ai = v4[i4++];
+        memcpy(&out->addrs[out->count], ai->ai_addr, ai->ai_addrlen);
+        out->addr_lens[out->count] = ai->ai_addrlen;
+        out->count++;
+        take_v6 = !take_v6;
+    }
+    freeaddrinfo(res);
+
+    if (out->count == 0) {
+        fprintf(stderr, "getaddrinfo: no usable address for %s\n", host);
+        return -1;
+    }
+
+    // Store it, replacing the entry that expires first
+    pthread_mutex_lock(&cache_lock);
+    int victim = 0;
+    for (int i = 0; i < DNS_CACHE_SIZE; i++) {
+        if (cache[i].port == port && strcmp(cache[i].host, host) == 0) {
+            victim = i;
+            break;
+        }
+        if (cache[i].expires < cache[victim].expires)
+            victim = i;
+    }
+    cache[victim] = *out;
+    save_cache();
+    pthread_mutex_unlock(&cache_lock);
+
+    return 0;
+}
+
+void forget_host(const char *host, int port) {
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < DNS_CACHE_SIZE; i++) {
+        if (cache[i].count > 0 && cache[i].port == port && strcmp(cache[i].host, host) == 0) {
+            memset(&cache[i], 0, sizeof(dns_entry));
+            save_cache();
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Starts a non-blocking connect. Returns the socket, or -1 if it failed right away
+static int start_attempt(const struct sockaddr_storage *addr, socklen_t len, int *connected) {
+    const int sock = socket(addr->ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return -1;
+
+    *connected = connect(sock, (const struct sockaddr *)addr, len) == 0;
+    if (!*connected && errno != EINPROGRESS) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+int connect_to_host(const char *host, int port) {
+    dns_entry entry;
+    if (resolve_host(host, port, &entry) != 0)
+        return -1;
+
+    struct pollfd pending[DNS_MAX_ADDRS];
+    int npending = 0;
+    int next = 0;
+    int winner = -1;
+    int last_error = ECONNREFUSED;
+    const long long deadline = now_ms() + CONNECT_TIMEOUT_MS;
+    long long next_attempt = 0;
+
+    while (winner < 0) {
+        const long long now = now_ms();
+        if (now >= deadline) {
+            last_error = ETIMEDOUT;
+            break;
+        }
+
+        // Start the next attempt when its turn has come
+        if (next < entry.count && now >= next_attempt) {
+            int connected;
+            const int sock = start_attempt(&entry.addrs[next], entry.addr_lens[next], &connected);
+            next++;
+            if (sock < 0) {
+                last_error = errno;
+                next_attempt = 0; // Failed immediately, move on right away
+                continue;
+            }
+            if (connected) {
+                winner = sock;
+                break;
+            }
+            pending[npending].fd = sock;
+            pending[npending].events = POLLOUT;
+            npending++;
+            next_attempt = now + CONNECTION_ATTEMPT_DELAY_MS;
+        }
+
+        if (npending == 0) {
+            if (next >= entry.count)
+                break;
+            continue;
+        }
+
+        long long timeout = deadline - now;
+        if (next < entry.count && next_attempt - now < timeout)
+            timeout = next_attempt - now;
+        if (timeout < 0)
+            timeout = 0;
+
+        if (poll(pending, npending, (int)timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            last_error = errno;
+            break;
+        }
+
+        for (int i = 0; i < npending && winner < 0; i++) {
+            if (pending[i].revents == 0)
+                continue;
+
+            int error = 0;
+            socklen_t error_len = sizeof(error);
+            getsockopt(pending[i].fd, SOL_SOCKET, SO_ERROR, &error, &error_len);
+            if (error == 0) {
+                winner = pending[i].fd;
+                pending[i] = pending[--npending];
+                break;
+            }
+
+            // This attempt failed, the next one may start now
+            last_error = error;
+            close(pending[i].fd);
+            pending[i] = pending[--npending];
+            next_attempt = 0;
+            i--;
+        }
+    }
+
+    // Abandon the attempts that lost the race
+    for (int i = 0; i < npending; i++)
+        close(pending[i].fd);
+
+    if (winner < 0) {
+        errno = last_error;
+        perror("connect");
+        forget_host(host, port);
+        return -1;
+    }
+
+    const int flags = fcntl(winner, F_GETFL);
+    fcntl(winner, F_SETFL, flags & ~O_NONBLOCK);
+    return winner;
+}
@@ -0,0 +1,61 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <sys/socket.h>
+#include <time.h>
+
+/**
+ * resolver.h
+ *
+ * getaddrinfo based name resolution with an in-process TTL cache, and a
+ * connect that races the resolved IPv6 and IPv4 addresses (RFC 8305).
+ *
+ * Setting HTTP_CLIENT_DNS_CACHE to a file path persists the cache
+ * between runs of the client.
+ */
+
+// getaddrinfo does not expose record TTLs, so every entry lives this long
+#define DNS_CACHE_TTL 60
+#define DNS_CACHE_SIZE 16
+#define DNS_MAX_ADDRS 8
+#define DNS_MAX_HOST 256
+#define DNS_CACHE_ENV "HTTP_CLIENT_DNS_CACHE"
+
+// RFC 8305 recommends 250ms between connection attempts
+#define CONNECTION_ATTEMPT_DELAY_MS 250
+#define CONNECT_TIMEOUT_MS 10000
+
+/**
+ * A resolved host. Addresses are kept in connection attempt order,
+ * alternating between address families.
+ */
+typedef struct dns_entry_st {
+    char host[DNS_MAX_HOST];
+    int port;
+    time_t expires;
+    int count;
+    struct sockaddr_storage addrs[DNS_MAX_ADDRS];
+    socklen_t addr_lens[DNS_MAX_ADDRS];
+} dns_entry;
+
+/**
+ * resolve_host fills "out" with the addresses of host:port, from the
+ * cache when a fresh entry exists. Returns 0 on success, -1 on failure.
+ */
+int resolve_host(const char *host, int port, dns_entry *out);
+
+/**
+ * forget_host drops the cached entry for host:port, e.g. after none of
+ * its addresses accepted a connection.
+ */
+void forget_host(const char *host, int port);
+
+/**
+ * connect_to_host resolves host:port and races connection attempts over
+ * its addresses, starting a new attempt every CONNECTION_ATTEMPT_DELAY_MS
+ * or as soon as one fails. Returns the first connected (blocking) socket,
+ * or -1 if every attempt failed or CONNECT_TIMEOUT_MS elapsed.
+ */
+int connect_to_host(const char *host, int port);
+
+#endif
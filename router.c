@@ -0,0 +1,409 @@
+#include "router.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define BUCKET_KEYS 4               //average exact paths per displacement bucket
+#define MAX_SEED_TRIES (1u << 20)   //per bucket, then the table is made larger
+#define NO_VALUE UINT32_MAX
+
+// A route waiting for router_freeze
+typedef struct pending_route_st {
+    const char *path;
+    size_t len;
+    route_entry entry;
+} pending_route;
+
+typedef struct route_list_st {
+    pending_route *items;
+    size_t count;
+    size_t capacity;
+} route_list;
+
+// Perfect hash slot, path is NULL if the slot is free
+typedef struct exact_slot_st {
+    uint64_t hash;
+    const char *path;
+    size_t len;
+    route_entry entry;
+} exact_slot;
+
+// Radix trie node. The children of a node are consecutive in the node array
+typedef struct trie_node_st {
+    const char *label;
+    uint32_t label_len;
+    uint32_t value;         //index into prefix_entries, NO_VALUE if no prefix ends here
+    uint32_t first_child;
+    uint32_t child_count;
+} trie_node;
+
+struct router_st {
+    route_list exact;
+    route_list prefixes;
+    int frozen;
+    char *strings;              //every registered path, back to back
+
+    uint32_t bucket_count;
+    uint32_t slot_count;
+    uint32_t *seeds;            //displacement per bucket
+    exact_slot *slots;
+
+    trie_node *nodes;
+    uint32_t node_count;
+    unsigned char *child_bytes; //first label byte of every node, scanned to pick a child
+    route_entry *prefix_entries;
+};
+
+// 64-bit FNV-1a
+static uint64_t hash_path(const char *path, const size_t len) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)path[i];
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+// splitmix64 finalizer, turns the path hash and a seed into an independent value
+static uint64_t mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+// Maps a 32-bit value onto [0, n) without a division
+static uint32_t reduce(const uint32_t x, const uint32_t n) {
+    return (uint32_t)(((uint64_t)x * n) >> 32);
+}
+
+static uint32_t bucket_of(const router *r, const uint64_t hash) {
+    return reduce((uint32_t)(hash >> 32), r->bucket_count);
+}
+
+static uint32_t slot_of(const router *r, const uint64_t hash, const uint32_t seed) {
+    return reduce((uint32_t)mix(hash ^ (seed * 0x9e3779b97f4a7c15ull)), r->slot_count);
+}
+
+router *router_create() {
+    return calloc(1, sizeof(router));
+}
+
+static int add_route(router *r, route_list *list, const char *path, const dispatch_fn handler, void *data) {
+    if (r->frozen || path == NULL || path[0] != '/' || handler == NULL)
+        return -1;
+    if (list->count == list->capacity) {
+        const size_t capacity = list->capacity ? list->capacity * 2 : 16;
+        pending_route *bigger = realloc(list->items, capacity * sizeof(pending_route));
+        if (bigger == NULL)
+            return -1;
+        list->items = bigger;
+        list->capacity = capacity;
+    }
+
+    char *copy = strdup(path);
+    if (copy == NULL)
+        return -1;
+    list->items[list->count++] = (pending_route){copy, strlen(copy), {handler, data}};
+    return 0;
+}
+
+int router_add_exact(router *r, const char *path, const dispatch_fn handler, void *data) {
+    return add_route(r, &r->exact, path, handler, data);
+}
+
+int router_add_prefix(router *r, const char *prefix, const dispatch_fn handler, void *data) {
+    return add_route(r, &r->prefixes, prefix, handler, data);
+}
+
+static int compare_routes(const void *a, const void *b) {
+    return strcmp(((const pending_route *)a)->path, ((const pending_route *)b)->path);
+}
+
+// Sorts a list and rejects duplicates, the trie build relies on the order
+static int sort_routes(route_list *list) {
+    if (list->count > 1)
+        qsort(list->items, list->count, sizeof(pending_route), compare_routes);
+    for (size_t i = 1; i < list->count; i++) {
+        if (strcmp(list->items[i - 1].path, list->items[i].path) == 0)
+            return -1;
+    }
+    return 0;
+}
+
+// Moves every path into one block, so the tables touch as few cache lines as possible
+static int pack_strings(router *r) {
+    size_t total = 0;
+    for (size_t i = 0; i < r->exact.count; i++)
+        total += r->exact.items[i].len + 1;
+    for (size_t i = 0; i < r->prefixes.count; i++)
+        total += r->prefixes.items[i].len + 1;
+
+    r->strings = malloc(total ? total : 1);
+    if (r->strings == NULL)
+        return -1;
+
+    char *p = r->strings;
+    route_list *lists[] = {&r->exact, &r->prefixes};
+    for (int l = 0; l < 2; l++) {
+        for (size_t i = 0; i < lists[l]->count; i++) {
+            pending_route *route = &lists[l]->items[i];
+            memcpy(p, route->path, route->len + 1);
+            free((char *)route->path);
+            route->path = p;
+            p += route->len + 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Hash and displace: paths are spread over buckets by their hash, then
+ * each bucket, largest first, gets the first seed that sends all of its
+ * paths to free slots. Returns 0 on success, 1 if some bucket found no
+ * seed (the caller retries with more slots), -1 on allocation failure.
+ */
+static int place_exact(router *r, const uint64_t *hashes) {
+    const uint32_t n = (uint32_t)r->exact.count;
+    uint32_t *bucket_size = calloc(r->bucket_count + 1, sizeof(uint32_t));
+    uint32_t *bucket_start = calloc(r->bucket_count + 1, sizeof(uint32_t));
+    uint32_t *members = malloc(n * sizeof(uint32_t));
+    uint32_t *order = malloc(r->bucket_count * sizeof(uint32_t));
+    uint32_t *candidate = malloc(n * sizeof(uint32_t));
+    int result = -1;
+    if (bucket_size == NULL || bucket_start == NULL || members == NULL || order == NULL || candidate == NULL)
+        goto done;
+
+    // Group the paths by bucket
+    for (uint32_t i = 0; i < n; i++)
+        bucket_size[bucket_of(r, hashes[i])]++;
+    for (uint32_t b = 0; b < r->bucket_count; b++)
+        bucket_start[b + 1] = bucket_start[b] + bucket_size[b];
+    memset(bucket_size, 0, r->bucket_count * sizeof(uint32_t));
+    for (uint32_t i = 0; i < n; i++) {
+        const uint32_t b = bucket_of(r, hashes[i]);
+        members[bucket_start[b] + bucket_size[b]++] = i;
+    }
+
+    // Largest buckets first, while the table is still empty (counting sort by size)
+    uint32_t largest = 0;
+    for (uint32_t b = 0; b < r->bucket_count; b++)
+        largest = bucket_size[b] > largest ? bucket_size[b] : largest;
+    uint32_t placed = 0;
+    for (uint32_t size = largest; size > 0; size--) {
+        for (uint32_t b = 0; b < r->bucket_count; b++) {
+            if (bucket_size[b] == size)
+                order[placed++] = b;
+        }
+    }
+
+    result = 1;
+    for (uint32_t o = 0; o < placed; o++) {
+        const uint32_t b = order[o];
+        const uint32_t *paths = members + bucket_start[b];
+        uint32_t seed;
+        for (seed = 0; seed < MAX_SEED_TRIES; seed++) {
+            uint32_t k;
+            for (k = 0; k < bucket_size[b]; k++) {
+                candidate[k] = slot_of(r, hashes[paths[k]], seed);
+                if (r->slots[candidate[k]].path != NULL)
+                    break;
+                // Two paths of the same bucket must not collide with each other either
+                uint32_t j;
+                for (j = 0; j < k && candidate[j] != candidate[k]; j++) {
+                }
+                if (j < k)
+                    break;
+            }
+            if (k == bucket_size[b])
+                break;
+        }
+        if (seed == MAX_SEED_TRIES)
+            goto done;
+
+        r->seeds[b] = seed;
+        for (uint32_t k = 0; k < bucket_size[b]; k++) {
+            const pending_route *route = &r->exact.items[paths[k]];
+            r->slots[candidate[k]] = (exact_slot){hashes[paths[k]], route->path, route->len, route->entry};
+        }
+    }
+    result = 0;
+
+done:
+    free(bucket_size);
+    free(bucket_start);
+    free(members);
+    free(order);
+    free(candidate);
+    return result;
+}
+
+static int build_exact(router *r) {
+    const size_t n = r->exact.count;
+    if (n == 0)
+        return 0;
+    if (n > UINT32_MAX / 2)
+        return -1;
+
+    uint64_t *hashes = malloc(n * sizeof(uint64_t));
+    if (hashes == NULL)
+        return -1;
+    for (size_t i = 0; i < n; i++)
+        hashes[i] = hash_path(r->exact.items[i].path, r->exact.items[i].len);
+
+    // Start at a load factor of 0.8, grow the table when a bucket cannot be placed
+    int result = 1;
+    r->bucket_count = (uint32_t)(n / BUCKET_KEYS + 1);
+    for (uint64_t slots = n + n / 4 + 1; result == 1 && slots <= 4 * (uint64_t)n + 8; slots += slots / 2) {
+        free(r->seeds);
+        free(r->slots);
+        r->slot_count = (uint32_t)slots;
+        r->seeds = calloc(r->bucket_count, sizeof(uint32_t));
+        r->slots = calloc(r->slot_count, sizeof(exact_slot));
+        result = r->seeds && r->slots ? place_exact(r, hashes) : -1;
+    }
+    free(hashes);
+    return result == 0 ? 0 : -1;
+}
+
+// Fills node "index" with the sorted prefixes [lo, hi), which share their first "depth" bytes
+static void build_node(router *r, const uint32_t index, const size_t lo, const size_t hi, const size_t depth) {
+    const pending_route *items = r->prefixes.items;
+    const pending_route *first = &items[lo], *last = &items[hi - 1];
+
+    // Sorted, so the common prefix of the range is that of its first and last path
+    size_t common = depth;
+    while (common < first->len && common < last->len && first->path[common] == last->path[common])
+        common++;
+
+    trie_node *node = &r->nodes[index];
+    node->label = first->path + depth;
+    node->label_len = (uint32_t)(common - depth);
+    node->value = NO_VALUE;
+    size_t i = lo;
+    if (first->len == common) {
+        node->value = (uint32_t)lo;     // the shortest path of the range ends here
+        i++;
+    }
+
+    // One child per distinct next byte, reserved together so siblings are adjacent
+    uint32_t children = 0;
+    for (size_t j = i; j < hi; j++) {
+        if (j == i || items[j].path[common] != items[j - 1].path[common])
+            children++;
+    }
+    node->first_child = r->node_count;
+    node->child_count = children;
+    r->node_count += children;
+
+    uint32_t child = node->first_child;
+    for (size_t start = i; start < hi; child++) {
+        size_t end = start + 1;
+        while (end < hi && items[end].path[common] == items[start].path[common])
+            end++;
+        r->child_bytes[child] = (unsigned char)items[start].path[common];
+        build_node(r, child, start, end, common);
+        start = end;
+    }
+}
+
+static int build_prefixes(router *r) {
+    const size_t n = r->prefixes.count;
+    if (n == 0)
+        return 0;
+    if (n > UINT32_MAX / 2)
+        return -1;
+
+    // A trie over n paths has at most 2n nodes
+    r->nodes = malloc((2 * n + 1) * sizeof(trie_node));
+    r->child_bytes = malloc(2 * n + 1);
+    r->prefix_entries = malloc(n * sizeof(route_entry));
+    if (r->nodes == NULL || r->child_bytes == NULL || r->prefix_entries == NULL)
+        return -1;
+
+    for (size_t i = 0; i < n; i++)
+        r->prefix_entries[i] = r->prefixes.items[i].entry;
+    r->child_bytes[0] = '/';
+    r->node_count = 1;
+    build_node(r, 0, 0, n, 0);
+    return 0;
+}
+
+int router_freeze(router *r) {
+    if (r->frozen)
+        return 0;
+    if (sort_routes(&r->exact) != 0 || sort_routes(&r->prefixes) != 0 || pack_strings(r) != 0 ||
+        build_exact(r) != 0 || build_prefixes(r) != 0)
+        return -1;
+
+    // The slots and nodes hold everything lookups need
+    free(r->exact.items);
+    free(r->prefixes.items);
+    r->exact = r->prefixes = (route_list){NULL, 0, 0};
+    r->frozen = 1;
+    return 0;
+}
+
+static const route_entry *lookup_exact(const router *r, const char *path, const size_t len) {
+    if (r->slot_count == 0)
+        return NULL;
+    const uint64_t hash = hash_path(path, len);
+    const exact_slot *slot = &r->slots[slot_of(r, hash, r->seeds[bucket_of(r, hash)])];
+    if (slot->path != NULL && slot->hash == hash && slot->len == len && memcmp(slot->path, path, len) == 0)
+        return &slot->entry;
+    return NULL;
+}
+
+static const route_entry *lookup_prefix(const router *r, const char *path, const size_t len) {
+    if (r->node_count == 0)
+        return NULL;
+
+    const route_entry *best = NULL;
+    size_t pos = 0;
+    const trie_node *node = &r->nodes[0];
+    while (1) {
+        if (len - pos < node->label_len || memcmp(path + pos, node->label, node->label_len) != 0)
+            break;
+        pos += node->label_len;
+
+        // Only at a segment boundary, "/api" must not match "/apix"
+        if (node->value != NO_VALUE &&
+            (pos == len || path[pos - 1] == '/' || path[pos] == '/' || path[pos] == '?'))
+            best = &r->prefix_entries[node->value];
+        if (pos == len || node->child_count == 0)
+            break;
+
+        const unsigned char *bytes = r->child_bytes + node->first_child;
+        const unsigned char *hit = memchr(bytes, path[pos], node->child_count);
+        if (hit == NULL)
+            break;
+        node = &r->nodes[node->first_child + (hit - bytes)];
+    }
+    return best;
+}
+
+const route_entry *router_lookup(const router *r, const char *path, const size_t len) {
+    const char *query = memchr(path, '?', len);
+    const route_entry *entry = lookup_exact(r, path, query ? (size_t)(query - path) : len);
+    return entry != NULL ? entry : lookup_prefix(r, path, len);
+}
+
+void router_destroy(router *r) {
+    if (r == NULL)
+        return;
+    route_list *lists[] = {&r->exact, &r->prefixes};
+    for (int l = 0; l < 2; l++) {
+        // Before router_freeze the paths are still separate copies
+        for (size_t i = 0; !r->frozen && r->strings == NULL && i < lists[l]->count; i++)
+            free((char *)lists[l]->items[i].path);
+        free(lists[l]->items);
+    }
+    free(r->strings);
+    free(r->seeds);
+    free(r->slots);
+    free(r->nodes);
+    free(r->child_bytes);
+    free(r->prefix_entries);
+    free(r);
+}
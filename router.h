@@ -0,0 +1,71 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <stddef.h>
+#include "threadpool.h"
+
+/**
+ * router.h
+ *
+ * Maps request paths to handlers. Routes are registered at startup, then
+ * router_freeze compiles them into two read-only tables:
+ *
+ *   - exact paths go into a minimal perfect hash (hash and displace): one
+ *     hash of the path, a seed from a small displacement array, one
+ *     string compare;
+ *   - prefixes go into a radix trie flattened into an array, whose walk
+ *     depends on the length of the path, not on the number of routes.
+ *
+ * Lookups never lock and never allocate, so any thread may route while
+ * the server runs.
+ */
+
+/**
+ * A handler and its private data. The handler is a dispatch_fn, so the
+ * event loop can hand it straight to the threadpool.
+ */
+typedef struct route_entry_st {
+    dispatch_fn handler;
+    void *data;
+} route_entry;
+
+typedef struct router_st router;
+
+/**
+ * router_create returns an empty router, or NULL on allocation failure.
+ */
+router *router_create();
+
+/**
+ * router_add_exact routes "path" (without query string) to "handler".
+ * Returns 0 on success, -1 on failure or after router_freeze.
+ */
+int router_add_exact(router *r, const char *path, dispatch_fn handler, void *data);
+
+/**
+ * router_add_prefix routes every path under "prefix" to "handler". A
+ * prefix matches at a segment boundary: "/api" matches "/api", "/api/x"
+ * and "/api?x" but not "/apix"; "/static/" matches anything below it.
+ * Returns 0 on success, -1 on failure or after router_freeze.
+ */
+int router_add_prefix(router *r, const char *prefix, dispatch_fn handler, void *data);
+
+/**
+ * router_freeze builds the lookup tables. Returns 0 on success, -1 on
+ * allocation failure or if a path was registered twice.
+ */
+int router_freeze(router *r);
+
+/**
+ * router_lookup returns the exact route of "path", else its longest
+ * matching prefix route, else NULL. The query string is ignored for
+ * exact routes. Only valid after router_freeze.
+ */
+const route_entry *router_lookup(const router *r, const char *path, size_t len);
+
+/**
+ * router_destroy frees the router and its tables.
+ */
+void router_destroy(router *r);
+
+#endif
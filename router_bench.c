@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "router.h"
+
+/**
+ * router_bench.c
+ *
+ * Route lookup cost with 10, 1k and 100k routes. Each size registers as
+ * many exact paths as prefixes and measures hits on both tables plus
+ * misses, against a strcmp chain over the same exact paths.
+ *
+ * Usage: router_bench [lookups]
+ */
+
+#define DEFAULT_LOOKUPS 2000000
+#define PATH_SIZE 64
+#define QUERIES 4096    //distinct request paths, cycled through
+
+static int handler(void *arg) {
+    (void)arg;
+    return 0;
+}
+
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Returns the number of routes found, so the lookups cannot be optimized away
+static long long run_router(const router *r, char (*queries)[PATH_SIZE], const size_t *lengths, long lookups,
+                            double *ns_per_lookup) {
+    long long found = 0;
+    const long long start = now_ns();
+    for (long i = 0; i < lookups; i++)
+        found += router_lookup(r, queries[i % QUERIES], lengths[i % QUERIES]) != NULL;
+    *ns_per_lookup = (double)(now_ns() - start) / lookups;
+    return found;
+}
+
+static long long run_chain(char (*paths)[PATH_SIZE], const int count, char (*queries)[PATH_SIZE], long lookups,
+                           double *ns_per_lookup) {
+    long long found = 0;
+    const long long start = now_ns();
+    for (long i = 0; i < lookups; i++) {
+        const char *query = queries[i % QUERIES];
+        for (int j = 0; j < count; j++) {
+            if (strcmp(paths[j], query) == 0) {
+                found++;
+                break;
+            }
+        }
+    }
+    *ns_per_lookup = (double)(now_ns() - start) / lookups;
+    return found;
+}
+
+int main(int argc, char *argv[]) {
+    const long lookups = argc > 1 ? atol(argv[1]) : DEFAULT_LOOKUPS;
+    const int sizes[] = {10, 1000, 100000};
+    char (*queries)[PATH_SIZE] = malloc(QUERIES * PATH_SIZE);
+    size_t *lengths = malloc(QUERIES * sizeof(size_t));
+    if (lookups <= 0 || queries == NULL || lengths == NULL) {
+        printf("Usage: router_bench [lookups]\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%8s %10s %12s %12s %12s %12s %12s\n", "routes", "freeze ms", "exact ns", "prefix ns", "miss ns",
+           "strcmp ns", "found");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        const int count = sizes[s];
+        char (*paths)[PATH_SIZE] = malloc((size_t)count * PATH_SIZE);
+        router *r = router_create();
+        if (paths == NULL || r == NULL) {
+            perror("malloc");
+            return EXIT_FAILURE;
+        }
+
+        for (int i = 0; i < count; i++) {
+            char prefix[PATH_SIZE];
+            snprintf(paths[i], PATH_SIZE, "/api/v1/users/%d/profile", i * 7919 % count);
+            snprintf(prefix, PATH_SIZE, "/static/%d", i);
+            if (router_add_exact(r, paths[i], handler, NULL) != 0 || router_add_prefix(r, prefix, handler, NULL) != 0) {
+                printf("router_add failed\n");
+                return EXIT_FAILURE;
+            }
+        }
+        const long long freeze_start = now_ns();
+        if (router_freeze(r) != 0) {
+            printf("router_freeze failed\n");
+            return EXIT_FAILURE;
+        }
+        const double freeze_ms = (now_ns() - freeze_start) / 1e6;
+
+        double exact_ns, prefix_ns, miss_ns, chain_ns;
+        long long found = 0;
+        srand(1);
+
+        for (int q = 0; q < QUERIES; q++)
+            lengths[q] = snprintf(queries[q], PATH_SIZE, "/api/v1/users/%d/profile", rand() % count);
+        found += run_router(r, queries, lengths, lookups, &exact_ns);
+
+        // The strcmp chain is linear, fewer lookups keep the 100k run short
+        const long chain_lookups = lookups / (count / 10 + 1) + 1;
+        if (run_chain(paths, count, queries, chain_lookups, &chain_ns) != chain_lookups)
+            printf("strcmp chain missed a route\n");
+
+        for (int q = 0; q < QUERIES; q++)
+            lengths[q] = snprintf(queries[q], PATH_SIZE, "/static/%d/css/site.css?v=3", rand() % count);
+        found += run_router(r, queries, lengths, lookups, &prefix_ns);
+
+        for (int q = 0; q < QUERIES; q++)
+            lengths[q] = snprintf(queries[q], PATH_SIZE, "/api/v2/users/%d/settings", rand() % count);
+        found += run_router(r, queries, lengths, lookups, &miss_ns);
+
+        printf("%8d %10.1f %12.1f %12.1f %12.1f %12.1f %12lld\n", count, freeze_ms, exact_ns, prefix_ns, miss_ns,
+               chain_ns, found);
+        router_destroy(r);
+        free(paths);
+    }
+
+    free(queries);
+    free(lengths);
+    return EXIT_SUCCESS;
+}
@@ -1,171 +1,1034 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <time.h>
 #include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
 #include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <dirent.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <linux/openat2.h>
+#include "threadpool.h"
+#include "timer_wheel.h"
+#include "metrics.h"
+#include "access_log.h"
+#include "arena.h"
+#include "proxy.h"
+#include "router.h"
+#include "dirlist.h"
+#include "upgrade.h"
 
 #define INITIAL_BUFFER_SIZE 8192
 #define FIRST_LINE_SIZE 4000
 #define PORT 8080
 #define MAX_REQUESTS 15
+#define POOL_SIZE 10
+#define MAX_QUEUE_SIZE 100
+#define MAX_EVENTS 256
+#define CONNECTION_ARENA_SIZE 4096  // per-request memory, larger requests spill to the heap
+#define MAX_FREE_CONNECTIONS 1024   // closed connections kept for reuse
+#define ROOT_ENV "HTTP_SERVER_ROOT"  // directory served as static files, index.html only if unset
+
+// Deadlines, in milliseconds
+#define TIMER_TICK_MS 100
+#define HEADER_TIMEOUT_MS 10000
+#define BODY_TIMEOUT_MS 30000
+#define IDLE_TIMEOUT_MS 15000
+#define WRITE_TIMEOUT_MS 30000
+
+// Connection states
+#define CONN_IDLE 0         // keep-alive, waiting for the next request
+#define CONN_READING_HEAD 1
+#define CONN_READING_BODY 2
+#define CONN_DISPATCHED 3   // owned by a worker
+
+// A client connection. Owned by the event loop, except while a worker runs it
+typedef struct connection_st {
+    int fd;
+    int state;
+    int keep_alive;
+    char method[16];
+    size_t length;          // bytes in buffer
+    size_t head_len;        // length of the request head once complete
+    size_t consumed;        // bytes of buffer that belong to the current request
+    size_t body_remaining;  // request body bytes still to be read and discarded
+    long long started_us;   // arrival of the request, for the latency histogram
+    const route_entry *route;   // handler of the request, NULL for the default one
+    int wants_json;         // Accept asked for application/json
+    int chunked;            // the request body has a Transfer-Encoding, never read
+    timer_node timer;
+    struct connection_st *next;
+    struct connection_st *open_prev;    // every open connection, walked when draining for an upgrade
+    struct connection_st *open_next;
+    const char *path;       // request target, in the arena
+    arena arena;            // reset after every request
+    char buffer[INITIAL_BUFFER_SIZE];
+    char arena_block[CONNECTION_ARENA_SIZE];
+} connection;
 
 // Function prototypes
 int handle_client(void *arg);
-char *build_http_response(int status_code);
-void write_to_client(int client_fd, const char *buffer);
+static int handle_metrics(void *arg);
+static int handle_proxy(void *arg);
+char *build_http_response(arena *a, int status_code, const char *mime_type, size_t content_length, int keep_alive,
+                          const char *extra_headers, size_t *length);
+int write_to_client(int client_fd, const char *buffer, size_t length);
 
-int read_and_write(int client_fd, const char *path);
+int read_and_write(int client_fd, int file_fd);
 
-// Main function
-int main(){
-    int server_fd, client_fd;
+static connection *open_connection(int fd);
+static void reset_connection(connection *conn);
+static int parse_request_head(connection *conn);
+static int process_input(connection *conn);
+static void send_error(connection *conn, int status_code);
+static void close_connection(connection *conn);
+static void release_connection(connection *conn);
+static void expire_connection(timer_node *timer, void *arg);
+static void request_done(const connection *conn, int status_code, size_t bytes_sent);
+static int serve_static(connection *conn);
+
+static threadpool *pool;
+static router *routes;
+static timer_wheel wheel;
+static int epoll_fd;
+static int wakeup_fd;
+static int root_fd = -1;
+static atomic_int draining;
+
+// Closed connections, reused by the next accept. Event loop only
+static connection *free_connections;
+static int free_count;
+
+// Open connections, so an upgrade can close the idle ones. Event loop only
+static connection *open_connections;
+static int open_count;
+
+// Connections handed back by workers, drained by the event loop
+static connection *returned_head;
+static pthread_mutex_t returned_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void reopen_access_log(int sig) {
+    (void)sig;
+    access_log_reopen();
+}
+
+#ifdef THREADPOOL_TRACE
+// Set by SIGUSR1, the event loop then writes threadpool-trace-<pid>.json
+static volatile sig_atomic_t trace_requested;
+
+static void request_trace(int sig) {
+    (void)sig;
+    trace_requested = 1;
+    eventfd_write(wakeup_fd, 1);
+}
+
+static void write_trace() {
+    char path[64];
+    snprintf(path, sizeof(path), "threadpool-trace-%d.json", (int)getpid());
+    FILE *out = fopen(path, "we");
+    if (out == NULL) {
+        perror("trace");
+        return;
+    }
+    threadpool_trace_dump(pool, out);
+    fclose(out);
+}
+#endif
+
+// Set by SIGUSR2, the event loop then starts the new binary
+static volatile sig_atomic_t upgrade_requested;
+
+static void request_upgrade(int sig) {
+    (void)sig;
+    upgrade_requested = 1;
+    eventfd_write(wakeup_fd, 1);
+}
+
+// Markers for the non-connection descriptors in epoll
+static int listen_marker;
+static int wakeup_marker;
+static int inotify_marker;
+static int upgrade_marker;
+
+static long long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static long long now_ms() {
+    return now_us() / 1000;
+}
+
+static unsigned long long deadline_tick(long long timeout_ms) {
+    return (unsigned long long)((now_ms() + timeout_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS);
+}
+
+static int parse_argument(const char *str, int *result) {
+    char *end;
+    const long value = strtol(str, &end, 10);
+    if (*str == '\0' || *end != '\0' || value < 0 || value > 65535)
+        return -1;
+    *result = (int)value;
+    return 0;
+}
+
+static int open_listener(const int port) {
     struct sockaddr_in address;
-    int addrlen = sizeof(address);
+    int server_fd;
 
     // Create socket
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-        return EXIT_FAILURE;
+    if ((server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        return -1;
     }
+    const int reuse = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
 
     // Configure server address
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = htonl(INADDR_ANY);
-    address.sin_port = htons(PORT);
+    address.sin_port = htons(port);
 
     // Bind the socket to the specified port
     if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-        return EXIT_FAILURE;
+        perror("bind");
+        close(server_fd);
+        return -1;
     }
 
     // Listen for incoming connections
-    if (listen(server_fd, 3) < 0) {
+    if (listen(server_fd, SOMAXCONN) < 0) {
+        close(server_fd);
+        return -1;
+    }
+    return server_fd;
+}
+
+// Stops accepting once the new binary is ready; idle keep-alive connections go now, the rest after their response
+static void hand_over(int *server_fd) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, *server_fd, NULL);
+    close(*server_fd);
+    *server_fd = -1;
+    atomic_store(&draining, 1);
+
+    connection *conn = open_connections;
+    while (conn != NULL) {
+        connection *next = conn->open_next;
+        // A request already sent but not yet read is served, with Connection: close, on the next wait
+        char byte;
+        if (conn->state == CONN_IDLE && recv(conn->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) <= 0)
+            close_connection(conn);
+        conn = next;
+    }
+}
+
+// Main function
+int main(int argc, char *argv[]){
+    int server_fd;
+    int port = PORT, pool_size = POOL_SIZE, queue_size = MAX_QUEUE_SIZE;
+    int max_requests = 0; // 0 = serve forever
+
+    if (argc != 1 && (argc != 5 || parse_argument(argv[1], &port) != 0 ||
+                      parse_argument(argv[2], &pool_size) != 0 ||
+                      parse_argument(argv[3], &queue_size) != 0 ||
+                      parse_argument(argv[4], &max_requests) != 0)) {
+        printf("Usage: server <port> <pool-size> <max-queue-size> <max-number-of-request>\n");
         return EXIT_FAILURE;
     }
 
-    while(1) {
-        int* client_socket = malloc(sizeof(int));
-        if (client_socket == NULL) {
+    // Writes to clients that went away must not kill the process
+    signal(SIGPIPE, SIG_IGN);
+
+    // Only the event loop takes SIGUSR1 and SIGUSR2, threads started before they are unblocked never see them
+    sigset_t loop_signals;
+    sigemptyset(&loop_signals);
+    sigaddset(&loop_signals, SIGUSR1);
+    sigaddset(&loop_signals, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &loop_signals, NULL);
+
+    // Optional access log, reopened on SIGHUP for rotation
+    const char *access_log_path = getenv(ACCESS_LOG_ENV);
+    if (access_log_path != NULL) {
+        if (access_log_start(access_log_path) != 0)
             return EXIT_FAILURE;
-        }
+        struct sigaction sa = {.sa_handler = reopen_access_log};
+        sigaction(SIGHUP, &sa, NULL);
+    }
+    // Routes are fixed from here on, anything unmatched goes to handle_client
+    routes = router_create();
+    if (routes == NULL || router_add_exact(routes, METRICS_PATH, handle_metrics, NULL) != 0)
+        return EXIT_FAILURE;
+    const char *proxy_routes = getenv(PROXY_ENV);
+    if (proxy_routes != NULL && proxy_init(proxy_routes, routes, handle_proxy) != 0)
+        return EXIT_FAILURE;
+    if (router_freeze(routes) != 0) {
+        fprintf(stderr, "router_freeze failed\n");
+        return EXIT_FAILURE;
+    }
+#ifdef THREADPOOL_TRACE
+    signal(SIGUSR1, request_trace);
+#endif
 
-        // Accept incoming connections
-        if ((client_fd = accept(server_fd, (struct sockaddr *) &address, (socklen_t *) &addrlen)) < 0) {
+    // Optional static root, its directory listings are cached until inotify reports a change
+    const char *root = getenv(ROOT_ENV);
+    int inotify_fd = -1;
+    if (root != NULL) {
+        root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        inotify_fd = dirlist_init(root);
+        if (root_fd < 0 || inotify_fd < 0) {
+            perror(root);
             return EXIT_FAILURE;
         }
+    }
 
-        *client_socket = client_fd;
-        handle_client(client_socket);
+    // Every connection is a descriptor, allow as many as the hard limit
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
     }
-}
 
-// Client handler
-int handle_client(void *arg) {
-    const int client_fd = *(int *)arg;
-    free(arg);
-    size_t total_bytes_read = 0;
-    ssize_t bytes_read;
-    char first_line[FIRST_LINE_SIZE] = {0};
-    char path[FIRST_LINE_SIZE] = {0};
+    // Started by an upgrade, the listening socket comes from the old process and was never closed
+    const int inherited = upgrade_inherit(&server_fd, 1);
+    if (inherited < 0) {
+        fprintf(stderr, "upgrade_inherit failed\n");
+        return EXIT_FAILURE;
+    }
+    if (inherited == 0 && (server_fd = open_listener(port)) < 0)
+        return EXIT_FAILURE;
+
+    // The binary upgrades start, read now: once it is replaced on disk /proc/self/exe names the old one
+    char exe[PATH_MAX];
+    const ssize_t exe_len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    exe[exe_len > 0 ? exe_len : 0] = '\0';
+
+    pool = create_threadpool(pool_size, queue_size);
+    if (pool == NULL) {
+        fprintf(stderr, "create_threadpool failed\n");
+        return EXIT_FAILURE;
+    }
+
+    // Workers signal finished connections through wakeup_fd
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd < 0 || wakeup_fd < 0) {
+        perror("epoll");
+        return EXIT_FAILURE;
+    }
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &listen_marker};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev);
+    ev.data.ptr = &wakeup_marker;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fd, &ev);
+    if (inotify_fd >= 0) {
+        ev.data.ptr = &inotify_marker;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, inotify_fd, &ev);
+    }
+    struct sigaction upgrade_action = {.sa_handler = request_upgrade, .sa_flags = SA_RESTART};
+    sigaction(SIGUSR2, &upgrade_action, NULL);
+    pthread_sigmask(SIG_UNBLOCK, &loop_signals, NULL);  // only now, one may already be pending
+    int upgrade_fd = -1, upgraded = 0;
+
+    // Spare descriptor, given up to shed a connection when we run out (EMFILE)
+    int spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
 
-    while((bytes_read = read(client_fd, &first_line[total_bytes_read], FIRST_LINE_SIZE)) > 0){
-        total_bytes_read += bytes_read;
-        first_line[total_bytes_read] = '\0'; // Null-terminate the buffer for safety
+    // Warm up before taking connections, an upgrade lets the old process serve meanwhile
+    proxy_warm();
+    if (root != NULL)
+        dirlist_release(dirlist_get(".", DIRLIST_HTML));
+    upgrade_ready();
 
-        // Check if the first line is complete
-        if(strstr(first_line, "\r\n")){
+    timer_wheel_init(&wheel, now_ms() / TIMER_TICK_MS);
+    struct epoll_event events[MAX_EVENTS];
+    int requests = 0;
+
+    // After a hand-over, run until the last connection is closed
+    while((max_requests == 0 || requests < max_requests) && (server_fd >= 0 || open_count > 0)) {
+        const int timeout = wheel.count > 0 ? (int)(TIMER_TICK_MS - now_ms() % TIMER_TICK_MS) : -1;
+        const int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
             break;
         }
+        // An empty wheel is not advanced while we wait, bring its clock up before anything is added
+        if (wheel.count == 0)
+            timer_advance(&wheel, now_ms() / TIMER_TICK_MS, expire_connection, NULL);
+#ifdef THREADPOOL_TRACE
+        if (trace_requested) {
+            trace_requested = 0;
+            write_trace();
+        }
+#endif
+        if (upgrade_requested) {
+            upgrade_requested = 0;
+            if (upgrade_fd < 0 && server_fd >= 0) {
+                upgrade_fd = upgrade_start(exe, argv, &server_fd, 1);
+                ev.data.ptr = &upgrade_marker;
+                if (upgrade_fd >= 0 && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, upgrade_fd, &ev) != 0) {
+                    upgrade_abort(upgrade_fd);
+                    upgrade_fd = -1;
+                }
+                if (upgrade_fd < 0)
+                    perror("upgrade");
+            }
+        }
+
+        for (int i = 0; i < n; i++) {
+            void *tag = events[i].data.ptr;
+
+            if (tag == &listen_marker) {
+                // Accept incoming connections
+                while (1) {
+                    const int client_fd = accept4(server_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                    if (client_fd < 0) {
+                        if ((errno == EMFILE || errno == ENFILE) && spare_fd >= 0) {
+                            close(spare_fd);
+                            close(accept(server_fd, NULL, NULL));
+                            spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                        }
+                        break;
+                    }
+
+                    connection *conn = open_connection(client_fd);
+                    if (conn == NULL) {
+                        close(client_fd);
+                        continue;
+                    }
+                    metrics_connection_opened();
+                    timer_add(&wheel, &conn->timer, deadline_tick(HEADER_TIMEOUT_MS));
+
+                    struct epoll_event client_ev = {.events = EPOLLIN | EPOLLRDHUP, .data.ptr = conn};
+                    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &client_ev);
+                }
+            } else if (tag == &wakeup_marker) {
+                // Take back the connections workers are done with
+                eventfd_t value;
+                eventfd_read(wakeup_fd, &value);
+                pthread_mutex_lock(&returned_lock);
+                connection *conn = returned_head;
+                returned_head = NULL;
+                pthread_mutex_unlock(&returned_lock);
+
+                while (conn != NULL) {
+                    connection *next = conn->next;
+                    if (!conn->keep_alive || atomic_load(&draining)) {
+                        close_connection(conn);
+                    } else {
+                        // Keep whatever the client pipelined after this request
+                        memmove(conn->buffer, conn->buffer + conn->consumed, conn->length - conn->consumed);
+                        conn->length -= conn->consumed;
+                        conn->consumed = 0;
+                        reset_connection(conn);
+                        conn->state = conn->length > 0 ? CONN_READING_HEAD : CONN_IDLE;
+                        conn->started_us = now_us();
+                        timer_add(&wheel, &conn->timer,
+                                  deadline_tick(conn->length > 0 ? HEADER_TIMEOUT_MS : IDLE_TIMEOUT_MS));
+
+                        struct epoll_event client_ev = {.events = EPOLLIN | EPOLLRDHUP, .data.ptr = conn};
+                        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->fd, &client_ev);
+                        if (conn->length > 0)
+                            requests += process_input(conn);
+                    }
+                    conn = next;
+                }
+            } else if (tag == &inotify_marker) {
+                dirlist_handle_events();
+            } else if (tag == &upgrade_marker) {
+                // The new process is ready, or failed and this one keeps serving
+                const int ready = upgrade_finish(upgrade_fd);
+                if (ready != 0)
+                    upgrade_fd = -1;
+                if (ready > 0)
+                    upgraded = 1;
+                else if (ready < 0)
+                    fprintf(stderr, "upgrade failed, still serving\n");
+            } else {
+                connection *conn = tag;
+                if (conn->state == CONN_READING_BODY) {
+                    // Discard the body, never reading past it into the next request
+                    char scratch[INITIAL_BUFFER_SIZE];
+                    const size_t want = conn->body_remaining < sizeof(scratch) ? conn->body_remaining : sizeof(scratch);
+                    const ssize_t bytes_read = read(conn->fd, scratch, want);
+                    if (bytes_read <= 0 && !(bytes_read < 0 && errno == EAGAIN)) {
+                        close_connection(conn);
+                        continue;
+                    }
+                    if (bytes_read > 0) {
+                        conn->body_remaining -= bytes_read;
+                        metrics_bytes_received(bytes_read);
+                    }
+                } else {
+                    const ssize_t bytes_read = read(conn->fd, conn->buffer + conn->length,
+                                                    sizeof(conn->buffer) - 1 - conn->length);
+                    if (bytes_read <= 0 && !(bytes_read < 0 && errno == EAGAIN)) {
+                        close_connection(conn);
+                        continue;
+                    }
+                    if (bytes_read > 0) {
+                        conn->length += bytes_read;
+                        metrics_bytes_received(bytes_read);
+                        if (conn->state == CONN_IDLE) {
+                            // The next request started, its head has a deadline of its own
+                            conn->state = CONN_READING_HEAD;
+                            conn->started_us = now_us();
+                            timer_add(&wheel, &conn->timer, deadline_tick(HEADER_TIMEOUT_MS));
+                        }
+                    }
+                }
+                requests += process_input(conn);
+            }
+        }
+
+        // After the batch, its events may belong to the idle connections closed here
+        if (upgraded && server_fd >= 0)
+            hand_over(&server_fd);
+
+        // Close every connection whose deadline passed
+        timer_advance(&wheel, now_ms() / TIMER_TICK_MS, expire_connection, NULL);
     }
 
+    // Stop accepting, let queued and running requests finish
+    if (server_fd >= 0)
+        close(server_fd);
+    atomic_store(&draining, 1);
+    destroy_threadpool(pool);
+    access_log_stop();
+    router_destroy(routes);
+    return EXIT_SUCCESS;
+}
+
+static const char *status_text(const int status_code) {
+    switch (status_code) {
+        case 200: return "OK";
+        case 301: return "Moved Permanently";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 408: return "Request Timeout";
+        case 411: return "Length Required";
+        case 431: return "Request Header Fields Too Large";
+        case 500: return "Internal Server Error";
+        case 503: return "Service Unavailable";
+        default: return "Error";
+    }
+}
+
+// Parses the request line and the headers the server acts on
+static int parse_request_head(connection *conn) {
+    const char *head_end = conn->buffer + conn->head_len;
+    const char *line = conn->buffer;
+    const char *eol = memmem(line, head_end - line, "\r\n", 2);
+
+    // Request line: METHOD SP target SP HTTP/1.x
+    const char *sp1 = memchr(line, ' ', eol - line);
+    if (sp1 == NULL || sp1 == line || (size_t)(sp1 - line) >= sizeof(conn->method))
+        return -1;
+    const char *sp2 = memchr(sp1 + 1, ' ', eol - sp1 - 1);
+    if (sp2 == NULL || eol - sp2 - 1 != 8 || strncmp(sp2 + 1, "HTTP/1.", 7) != 0)
+        return -1;
+    const size_t target_len = sp2 - sp1 - 1;
+    if (target_len == 0 || target_len >= FIRST_LINE_SIZE)
+        return -1;
+
+    memcpy(conn->method, line, sp1 - line);
+    conn->method[sp1 - line] = '\0';
+    const char *path = arena_strndup(&conn->arena, sp1 + 1, target_len);
+    if (path == NULL)
+        return -1;
+    conn->path = path;
+    const int minor = sp2[8] - '0';
+
+    int close_requested = 0, keep_alive_requested = 0;
+    conn->body_remaining = 0;
+    conn->wants_json = 0;
+    conn->chunked = 0;
+    for (line = eol + 2; line < head_end - 2; line = eol + 2) {
+        eol = memmem(line, head_end - line, "\r\n", 2);
+        if (strncasecmp(line, "content-length:", 15) == 0) {
+            conn->body_remaining = strtoull(line + 15, NULL, 10);
+        } else if (strncasecmp(line, "transfer-encoding:", 18) == 0) {
+            conn->chunked = 1;
+        } else if (strncasecmp(line, "connection:", 11) == 0) {
+            const char *value = line + 11;
+            while (*value == ' ' || *value == '\t') value++;
+            close_requested = strncasecmp(value, "close", 5) == 0;
+            keep_alive_requested = strncasecmp(value, "keep-alive", 10) == 0;
+        } else if (strncasecmp(line, "accept:", 7) == 0) {
+            conn->wants_json = memmem(line, eol - line, "application/json", 16) != NULL;
+        }
+    }
+
+    conn->keep_alive = minor >= 1 ? !close_requested : keep_alive_requested;
+
+    // Chunked request bodies are not supported, answer and close instead
+    if (conn->chunked) {
+        conn->keep_alive = 0;
+        conn->body_remaining = 0;
+    }
+    return 0;
+}
+
+// Advances a connection after new input. Returns 1 if a request was dispatched
+static int process_input(connection *conn) {
+    if (conn->state == CONN_READING_HEAD) {
+        char *end = memmem(conn->buffer, conn->length, "\r\n\r\n", 4);
+        if (end == NULL) {
+            if (conn->length >= sizeof(conn->buffer) - 1) {
+                send_error(conn, 431);
+                close_connection(conn);
+            }
+            return 0;
+        }
+
+        conn->head_len = end + 4 - conn->buffer;
+        if (parse_request_head(conn) != 0) {
+            send_error(conn, 400);
+            close_connection(conn);
+            return 0;
+        }
+
+        // Part of the body may have arrived with the head
+        const size_t available = conn->length - conn->head_len;
+        const size_t in_buffer = available < conn->body_remaining ? available : conn->body_remaining;
+        conn->consumed = conn->head_len + in_buffer;
+        conn->body_remaining -= in_buffer;
+
+        // A proxied body is forwarded by the worker, any other is read and dropped here
+        conn->route = router_lookup(routes, conn->path, strlen(conn->path));
+        if (conn->chunked && conn->route != NULL && conn->route->handler == handle_proxy) {
+            // Its body would be lost upstream, the client has to send a Content-Length
+            send_error(conn, 411);
+            close_connection(conn);
+            return 0;
+        }
+        if (conn->body_remaining > 0 && (conn->route == NULL || conn->route->handler != handle_proxy)) {
+            conn->state = CONN_READING_BODY;
+            timer_add(&wheel, &conn->timer, deadline_tick(BODY_TIMEOUT_MS));
+            return 0;
+        }
+    } else if (conn->state != CONN_READING_BODY || conn->body_remaining > 0) {
+        return 0;
+    }
+
+    // The request is complete, hand it to a worker
+    timer_remove(&wheel, &conn->timer);
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    conn->state = CONN_DISPATCHED;
+    if (try_dispatch(pool, conn->route ? conn->route->handler : handle_client, conn) != 0) {
+        metrics_accept_queue_drop();
+        send_error(conn, 503);
+        close_connection(conn);
+        return 0;
+    }
+    return 1;
+}
+
+// Best effort, never blocks the event loop
+static void send_error(connection *conn, const int status_code) {
+    char response[160];
+    const int len = snprintf(response, sizeof(response),
+                             "HTTP/1.1 %d %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n",
+                             status_code, status_text(status_code));
+    const ssize_t sent = send(conn->fd, response, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    request_done(conn, status_code, sent > 0 ? sent : 0);
+}
+
+// Takes a connection from the free list, or allocates one
+static connection *open_connection(const int fd) {
+    connection *conn = free_connections;
+    if (conn != NULL) {
+        free_connections = conn->next;
+        free_count--;
+    } else {
+        conn = malloc(sizeof(connection));
+        if (conn == NULL)
+            return NULL;
+        arena_init(&conn->arena, conn->arena_block, sizeof(conn->arena_block));
+    }
+
+    memset(conn, 0, offsetof(connection, path));
+    conn->open_next = open_connections;
+    if (open_connections != NULL)
+        open_connections->open_prev = conn;
+    open_connections = conn;
+    open_count++;
+    conn->fd = fd;
+    conn->state = CONN_READING_HEAD;
+    conn->started_us = now_us();
+    conn->path = "";
+    timer_init(&conn->timer);
+    return conn;
+}
+
+// Frees everything the last request allocated
+static void reset_connection(connection *conn) {
+    arena_reset(&conn->arena);
+    conn->path = "";
+    conn->method[0] = '\0';
+}
+
+// Only the event loop closes connections
+static void close_connection(connection *conn) {
+    timer_remove(&wheel, &conn->timer);
+    close(conn->fd);
+    reset_connection(conn);
+    if (conn->open_prev != NULL)
+        conn->open_prev->open_next = conn->open_next;
+    else
+        open_connections = conn->open_next;
+    if (conn->open_next != NULL)
+        conn->open_next->open_prev = conn->open_prev;
+    open_count--;
+    if (free_count < MAX_FREE_CONNECTIONS) {
+        conn->next = free_connections;
+        free_connections = conn;
+        free_count++;
+    } else {
+        free(conn);
+    }
+    metrics_connection_closed();
+}
+
+// Hands a connection back to the event loop, from a worker
+static void release_connection(connection *conn) {
+    pthread_mutex_lock(&returned_lock);
+    conn->next = returned_head;
+    returned_head = conn;
+    pthread_mutex_unlock(&returned_lock);
+    eventfd_write(wakeup_fd, 1);
+}
+
+// Accounts a finished request in the metrics and the access log
+static void request_done(const connection *conn, const int status_code, const size_t bytes_sent) {
+    const long long latency_us = now_us() - conn->started_us;
+    metrics_request_done(status_code, bytes_sent, latency_us);
+    access_log_record(conn->method, conn->path, status_code, bytes_sent, latency_us);
+}
+
+static void expire_connection(timer_node *timer, void *arg) {
+    (void)arg;
+    metrics_connection_timeout();
+    close_connection((connection *)((char *)timer - offsetof(connection, timer)));
+}
+
+// Every handler starts here, a draining server finishes the request and closes
+static connection *start_request(void *arg) {
+    connection *conn = (connection *)arg;
+    if (atomic_load(&draining))
+        conn->keep_alive = 0;
+    return conn;
+}
+
+// Reserved path, answered from the counters instead of the filesystem
+static int handle_metrics(void *arg) {
+    connection *conn = start_request(arg);
+    size_t bytes_sent = 0;
+    size_t body_length = 0;
+    char *body = metrics_render(pool, &body_length);
+    const int status_code = body ? 200 : 500;
+    size_t response_length;
+    const char *response = build_http_response(&conn->arena, status_code, METRICS_CONTENT_TYPE, body_length,
+                                               conn->keep_alive, "", &response_length);
+    // HEAD gets the Content-Length of the body it would have had, not the body
+    const size_t sent_body = strcmp(conn->method, "HEAD") != 0 ? body_length : 0;
+    if (response == NULL || write_to_client(conn->fd, response, response_length) != 0 ||
+        (sent_body > 0 && write_to_client(conn->fd, body, sent_body) != 0))
+        conn->keep_alive = 0;
+    else
+        bytes_sent = response_length + sent_body;
+
+    request_done(conn, status_code, bytes_sent);
+    free(body);
+    release_connection(conn);
+    return 0;
+}
+
+// Prefixes mapped to an upstream, the route data is its proxy_route
+static int handle_proxy(void *arg) {
+    connection *conn = start_request(arg);
+    size_t bytes_sent = 0;
+    proxy_request req = {
+        .client_fd = conn->fd,
+        .method = conn->method,
+        .path = conn->path,
+        .head = conn->buffer,
+        .head_len = conn->head_len,
+        .body = conn->buffer + conn->head_len,
+        .body_len = conn->consumed - conn->head_len,
+        .body_remaining = conn->body_remaining,
+        .keep_alive = conn->keep_alive,
+    };
+    const int status_code = proxy_forward(conn->route->data, &req, &conn->arena, &bytes_sent);
+    conn->keep_alive = req.keep_alive && req.body_remaining == 0;
+    request_done(conn, status_code, bytes_sent);
+    release_connection(conn);
+    return 0;
+}
+
+// Client handler, for every path without a route of its own
+int handle_client(void *arg) {
+    connection *conn = start_request(arg);
+    if (root_fd >= 0)
+        return serve_static(conn);
+
+    char path[FIRST_LINE_SIZE] = {0};
+    struct stat st;
+    size_t bytes_sent = 0;
+
     strcpy(path, "index.html");
-    const int status_code = 200;
+    int status_code = 200;
 
-    // Construct response
-    char *response = build_http_response(status_code);
+    const int file_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (file_fd < 0 || fstat(file_fd, &st) != 0)
+        status_code = 404;
+    const size_t content_length = status_code == 200 ? (size_t)st.st_size : 0;
 
-    write:
-    // Write the response to client
-    write_to_client(client_fd, response);
+    // Construct response
+    size_t response_length;
+    const char *response = build_http_response(&conn->arena, status_code, "text/html", content_length,
+                                               conn->keep_alive, "", &response_length);
 
-    read_and_write(client_fd, path);
+    // Write the response to client, a failed write ends the connection
+    if (response == NULL || write_to_client(conn->fd, response, response_length) != 0) {
+        conn->keep_alive = 0;
+    } else {
+        bytes_sent = response_length;
+        if (status_code == 200 && strcmp(conn->method, "HEAD") != 0) {
+            if (read_and_write(conn->fd, file_fd) != 0)
+                conn->keep_alive = 0;
+            else
+                bytes_sent += content_length;
+        }
+    }
 
-    close(client_fd);
-    free(response);
+    request_done(conn, status_code, bytes_sent);
+    if (file_fd >= 0)
+        close(file_fd);
+    release_connection(conn);
 
     return 0;
 }
 
-// Build HTTP response
-char * build_http_response(const int status_code) {
-    char date_header[128];
+static int hex_value(const char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
 
-    // Determine status text
-    const char *status_text = "OK";
-    const char *mime_type = "text/html";
-    char *OK_body = "";
+/**
+ * Turns a request target into a path relative to the static root: the
+ * query is cut off, escapes are decoded, empty and "." segments are
+ * dropped and ".." is refused. The root itself is ".". Sets
+ * "trailing_slash" if the target ended in '/'. Returns NULL for a
+ * target that cannot name a file under the root.
+ */
+static char *resolve_target(arena *a, const char *target, int *trailing_slash) {
+    const size_t target_len = strcspn(target, "?");
+    char *path = arena_alloc(a, target_len + 2);
+    if (path == NULL || target[0] != '/')
+        return NULL;
 
-    // Calculate the response size
-    const size_t body_length = 0;
-    const int response_size = 256 + body_length; // Headers + body
+    size_t length = 0;
+    for (size_t i = 0; i < target_len;) {
+        // One segment, decoded in place after the separator
+        const size_t start = length;
+        while (i < target_len && target[i] == '/')
+            i++;
+        while (i < target_len && target[i] != '/') {
+            char c = target[i++];
+            if (c == '%') {
+                const int high = i + 1 < target_len ? hex_value(target[i]) : -1;
+                const int low = high >= 0 ? hex_value(target[i + 1]) : -1;
+                if (low < 0)
+                    return NULL;
+                c = (char)(high << 4 | low);
+                i += 2;
+            }
+            if (c == '\0' || c == '/')
+                return NULL;
+            path[length++] = c;
+        }
+        const size_t segment_len = length - start;
+        if (segment_len == 2 && path[start] == '.' && path[start + 1] == '.')
+            return NULL;
+        if (segment_len == 0 || (segment_len == 1 && path[start] == '.'))
+            length = start;
+        else if (i < target_len)
+            path[length++] = '/';
+    }
+    if (length > 0 && path[length - 1] == '/')
+        length--;
+    if (length == 0)
+        path[length++] = '.';
+    path[length] = '\0';
+    *trailing_slash = target[target_len - 1] == '/';
+    return path;
+}
 
-    // Allocate memory for the response
-    char *response = malloc(response_size);
+static const char *content_type(const char *path) {
+    static const char *const types[][2] = {
+        {".html", "text/html"}, {".htm", "text/html"}, {".css", "text/css"},
+        {".js", "text/javascript"}, {".json", "application/json"}, {".txt", "text/plain"},
+        {".png", "image/png"}, {".jpg", "image/jpeg"}, {".jpeg", "image/jpeg"},
+        {".gif", "image/gif"}, {".svg", "image/svg+xml"}, {".ico", "image/x-icon"},
+        {".pdf", "application/pdf"},
+    };
+    const char *dot = strrchr(path, '.');
+    for (size_t i = 0; dot != NULL && i < sizeof(types) / sizeof(types[0]); i++) {
+        if (strcasecmp(dot, types[i][0]) == 0)
+            return types[i][1];
+    }
+    return "application/octet-stream";
+}
 
-    int written = 0;
-    // Build the response headers
-    written += snprintf(response, response_size,
-             "HTTP/1.0 %d %s\r\n"
-             "Server: webserver/1.0\r\n"
-             "Date: %s\r\n",
-             status_code, status_text, date_header);
+// Writes a response head and, unless the method is HEAD, the body from memory or a file
+static size_t send_response(connection *conn, const int status_code, const char *mime_type, const char *extra_headers,
+                            const char *body, const int file_fd, const size_t content_length) {
+    size_t response_length;
+    const char *response = build_http_response(&conn->arena, status_code, mime_type, content_length,
+                                               conn->keep_alive, extra_headers, &response_length);
+    if (response == NULL || write_to_client(conn->fd, response, response_length) != 0) {
+        conn->keep_alive = 0;
+        return 0;
+    }
+    if (strcmp(conn->method, "HEAD") == 0 || content_length == 0)
+        return response_length;
+    if ((body != NULL && write_to_client(conn->fd, body, content_length) != 0) ||
+        (body == NULL && read_and_write(conn->fd, file_fd) != 0)) {
+        conn->keep_alive = 0;
+        return response_length;
+    }
+    return response_length + content_length;
+}
 
-    // Add Content-Type header
-    written += snprintf(response + written, response_size - written, "Content-Type: %s\r\n", mime_type);
+// Opens "path" under "dir_fd"; symlinks are followed only while they stay beneath it, the rest fail with EXDEV
+static int open_beneath(const int dir_fd, const char *path) {
+    struct open_how how = {.flags = O_RDONLY | O_CLOEXEC, .resolve = RESOLVE_BENEATH};
+    return (int)syscall(SYS_openat2, dir_fd, path, &how, sizeof(how));
+}
 
-    // Add Content-Length header
-    const size_t cont_length = 27; // 27 bytes for fixed index.html
-    written += snprintf(response + written, response_size - written, "Content-Length: %lu\r\n", cont_length);
+// Files under HTTP_SERVER_ROOT, directories get their index.html or a generated listing
+static int serve_static(connection *conn) {
+    int status_code = 200;
+    size_t bytes_sent = 0;
+    struct stat st;
+    int trailing_slash = 0;
+    const char *path = resolve_target(&conn->arena, conn->path, &trailing_slash);
+    int fd = path ? open_beneath(root_fd, path) : -1;
 
-    // Add Connection header
-    written += snprintf(response + written, response_size - written, "Connection: close\r\n\r\n");
+    if (path == NULL) {
+        status_code = 400;
+    } else if (fd < 0 || fstat(fd, &st) != 0 || !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode))) {
+        status_code = 404;
+    } else if (S_ISDIR(st.st_mode) && !trailing_slash) {
+        // Relative links in the listing need the slash, send the client there
+        const char *query = strchr(conn->path, '?');
+        size_t response_length;
+        const char *response = arena_printf(&conn->arena, &response_length,
+                                            "HTTP/1.1 301 %s\r\nLocation: %.*s/%s\r\n"
+                                            "Content-Length: 0\r\nConnection: %s\r\n\r\n",
+                                            status_text(301), (int)strcspn(conn->path, "?"), conn->path,
+                                            query ? query : "", conn->keep_alive ? "keep-alive" : "close");
+        status_code = 301;
+        if (response == NULL || write_to_client(conn->fd, response, response_length) != 0)
+            conn->keep_alive = 0;
+        else
+            bytes_sent = response_length;
+    } else if (S_ISDIR(st.st_mode)) {
+        const int index_fd = open_beneath(fd, "index.html");
+        if (index_fd >= 0 && fstat(index_fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            close(fd);
+            fd = index_fd;
+            bytes_sent = send_response(conn, 200, "text/html", "", NULL, fd, st.st_size);
+        } else {
+            if (index_fd >= 0)
+                close(index_fd);
+            const char *query = strchr(conn->path, '?');
+            const int json = conn->wants_json || (query != NULL && strstr(query, "format=json") != NULL);
+            dir_listing *listing = dirlist_get(path, json ? DIRLIST_JSON : DIRLIST_HTML);
+            if (listing == NULL) {
+                status_code = 500;
+                bytes_sent = send_response(conn, status_code, "text/html", "", NULL, -1, 0);
+            } else {
+                // The representation depends on Accept, shared caches must key on it
+                bytes_sent = send_response(conn, 200, json ? "application/json" : "text/html; charset=utf-8",
+                                           "Vary: Accept\r\n", listing->data, -1, listing->length);
+                dirlist_release(listing);
+            }
+        }
+    } else {
+        bytes_sent = send_response(conn, 200, content_type(path), "", NULL, fd, st.st_size);
+    }
+    if (status_code == 400 || status_code == 404)
+        bytes_sent = send_response(conn, status_code, "text/html", "", NULL, -1, 0);
 
-    // Add the body to the response
-    char *src = OK_body;
-    snprintf(response + written, response_size - written, "%s", src);
+    request_done(conn, status_code, bytes_sent);
+    if (fd >= 0)
+        close(fd);
+    release_connection(conn);
+    return 0;
+}
 
-    if (strlen(OK_body) > 0)
-        free(OK_body);
+// Build HTTP response headers in the connection's arena, the body is streamed.
+// "extra_headers" are complete "Name: value\r\n" lines, "" for none
+char * build_http_response(arena *a, const int status_code, const char *mime_type, const size_t content_length,
+                           const int keep_alive, const char *extra_headers, size_t *length) {
+    char date_header[64];
+    const time_t now = time(NULL);
+    struct tm tm;
+    strftime(date_header, sizeof(date_header), "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&now, &tm));
 
-    return response;
+    return arena_printf(a, length,
+                        "HTTP/1.1 %d %s\r\n"
+                        "Server: webserver/1.0\r\n"
+                        "Date: %s\r\n"
+                        "Content-Type: %s\r\n"
+                        "Content-Length: %zu\r\n"
+                        "Connection: %s\r\n"
+                        "%s\r\n",
+                        status_code, status_text(status_code), date_header, mime_type, content_length,
+                        keep_alive ? "keep-alive" : "close", extra_headers);
 }
 
-// Write response to client
-void write_to_client(const int client_fd, const char *buffer){
-    // Send the request
+// Write response to client, waiting up to WRITE_TIMEOUT_MS whenever the socket is full
+int write_to_client(const int client_fd, const char *buffer, const size_t length){
     size_t total_sent = 0;
-    const size_t buffer_len = strlen(buffer);
-    while (total_sent < buffer_len) {
-        const ssize_t bytes_sent = write(client_fd, buffer + total_sent, buffer_len - total_sent);
+    while (total_sent < length) {
+        const ssize_t bytes_sent = write(client_fd, buffer + total_sent, length - total_sent);
+        if (bytes_sent < 0) {
+            if (errno == EINTR)
+                continue;
+            struct pollfd pfd = {.fd = client_fd, .events = POLLOUT};
+            if (errno != EAGAIN || poll(&pfd, 1, WRITE_TIMEOUT_MS) <= 0)
+                return -1;
+            continue;
+        }
         total_sent += bytes_sent;
     }
+    return 0;
 }
 
-int read_and_write(const int client_fd, const char *path){
-    // Open the file
-    const int file_fd = open(path, O_RDONLY);
-    if(file_fd < 0)
-        return -1;
-
+int read_and_write(const int client_fd, const int file_fd){
     char buffer[4096];
-    size_t bytesRead;
+    ssize_t bytesRead;
     // Read the file into the buffer and write to client
     while ((bytesRead = read(file_fd, buffer, sizeof(buffer))) > 0) {
-        write(client_fd, buffer, bytesRead); // Write the data
+        if (write_to_client(client_fd, buffer, bytesRead) != 0) // Write the data
+            return -1;
     }
 
-    close(file_fd);
-    return 0;
-}
\ No newline at end of file
+    return bytesRead < 0 ? -1 : 0;
+}
@@ -2,6 +2,24 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#ifdef THREADPOOL_TRACE
+#include <time.h>
+
+static unsigned long long trace_now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int trace_bucket(unsigned long long ns){
+    const int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+    return bucket < TRACE_BUCKETS ? bucket : TRACE_BUCKETS - 1;
+}
+
+// Single writer, readers tolerate a stale value but never a torn one
+#define TRACE_ADD(field, n) __atomic_store_n(&(field), __atomic_load_n(&(field), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+#define TRACE_READ(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+#endif
 
 threadpool* create_threadpool(int num_threads_in_pool, int max_queue_size){
     // Input validation
@@ -44,6 +62,23 @@ threadpool* create_threadpool(int num_threads_in_pool, int max_queue_size){
         return NULL;
     }
 
+#ifdef THREADPOOL_TRACE
+    // calloc only aligns to 16, each trace needs its own cache line; sizeof is already a multiple of 64
+    tp->traces = (worker_trace*) aligned_alloc(_Alignof(worker_trace), tp->num_threads * sizeof(worker_trace));
+    if(tp->traces != NULL)
+        memset(tp->traces, 0, tp->num_threads * sizeof(worker_trace));
+    if(tp->traces == NULL){
+        perror("aligned_alloc");
+        pthread_mutex_destroy(&(tp->qlock));
+        pthread_cond_destroy(&(tp->q_not_empty));
+        pthread_cond_destroy(&(tp->q_empty));
+        pthread_cond_destroy(&(tp->q_not_full));
+        free(tp->threads);
+        free(tp);
+        return NULL;
+    }
+#endif
+
     for (int i = 0; i < num_threads_in_pool; i++) {
         if (pthread_create(&(tp->threads[i]), NULL, do_work, tp) != 0){
             perror("create threads");
@@ -52,6 +87,9 @@ threadpool* create_threadpool(int num_threads_in_pool, int max_queue_size){
                 pthread_join(tp->threads[j], NULL); // Wait for created threads to finish
             }
             free(tp->threads);
+#ifdef THREADPOOL_TRACE
+            free(tp->traces);
+#endif
             pthread_mutex_destroy(&(tp->qlock));
             pthread_cond_destroy(&(tp->q_not_empty));
             pthread_cond_destroy(&(tp->q_empty));
@@ -75,6 +113,9 @@ void dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg){
     work->routine = dispatch_to_here;
     work->arg = arg;
     work->next = NULL;
+#ifdef THREADPOOL_TRACE
+    work->enqueued_ns = trace_now();
+#endif
 
     // 2. lock the mutex
     pthread_mutex_lock(&from_me->qlock);
@@ -118,10 +159,61 @@ void dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg){
     pthread_mutex_unlock(&from_me->qlock);
 }
 
+int try_dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg){
+    if(from_me == NULL || dispatch_to_here == NULL)
+        return -1;
+
+    work_t* work = (work_t*) malloc(sizeof(work_t));
+    if (work == NULL)
+        return -1;
+    work->routine = dispatch_to_here;
+    work->arg = arg;
+    work->next = NULL;
+#ifdef THREADPOOL_TRACE
+    work->enqueued_ns = trace_now();
+#endif
+
+    pthread_mutex_lock(&from_me->qlock);
+
+    // Refuse instead of waiting
+    if(from_me->dont_accept || from_me->qsize >= from_me->max_qsize){
+        pthread_mutex_unlock(&from_me->qlock);
+        free(work);
+        return -1;
+    }
+
+    if(from_me->qsize == 0){
+        from_me->qhead = work;
+        from_me->qtail = work;
+    }
+    else{
+        from_me->qtail->next = work;
+        from_me->qtail = work;
+    }
+    from_me->qsize++;
+
+    pthread_cond_signal(&from_me->q_not_empty);
+    pthread_mutex_unlock(&from_me->qlock);
+    return 0;
+}
+
+int threadpool_queue_size(threadpool* from_me){
+    pthread_mutex_lock(&from_me->qlock);
+    const int qsize = from_me->qsize;
+    pthread_mutex_unlock(&from_me->qlock);
+    return qsize;
+}
+
 void* do_work(void* p){
     threadpool *tp = (threadpool*) p;
+#ifdef THREADPOOL_TRACE
+    worker_trace *trace = &tp->traces[__atomic_fetch_add(&tp->next_worker, 1, __ATOMIC_RELAXED)];
+#endif
 
     while(1) {
+#ifdef THREADPOOL_TRACE
+        const unsigned long long idle_since = trace_now();
+#endif
         pthread_mutex_lock(&tp->qlock);
         while(tp->qsize == 0 && !tp->shutdown)
             pthread_cond_wait(&tp->q_not_empty, &tp->qlock);
@@ -147,12 +239,77 @@ void* do_work(void* p){
         pthread_mutex_unlock(&tp->qlock);
 
         if(work){
+#ifdef THREADPOOL_TRACE
+            const unsigned long long started = trace_now();
             (*(work->routine))(work->arg);
+            const unsigned long long finished = trace_now();
+
+            TRACE_ADD(trace->jobs, 1);
+            TRACE_ADD(trace->idle_ns, started - idle_since);
+            TRACE_ADD(trace->busy_ns, finished - started);
+            TRACE_ADD(trace->wait_hist[trace_bucket(started - work->enqueued_ns)], 1);
+            TRACE_ADD(trace->run_hist[trace_bucket(finished - started)], 1);
+
+            trace_event *event = &trace->ring[trace->ring_head % TRACE_RING_SIZE];
+            event->enqueued_ns = work->enqueued_ns;
+            event->started_ns = started;
+            event->finished_ns = finished;
+            __atomic_store_n(&trace->ring_head, trace->ring_head + 1, __ATOMIC_RELEASE);
+#else
+            (*(work->routine))(work->arg);
+#endif
             free(work);
         }
     }
 }
 
+#ifdef THREADPOOL_TRACE
+static void dump_histogram(FILE* out, const char* name, const unsigned long long* hist){
+    fprintf(out, "\"%s\": [", name);
+    for(int b = 0; b < TRACE_BUCKETS; b++)
+        fprintf(out, "%s%llu", b ? ", " : "", TRACE_READ(hist[b]));
+    fprintf(out, "]");
+}
+
+void threadpool_trace_dump(threadpool* from_me, FILE* out){
+    fprintf(out, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    int first = 1;
+    for(int i = 0; i < from_me->num_threads; i++){
+        worker_trace *trace = &from_me->traces[i];
+        fprintf(out, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+                     "\"args\": {\"name\": \"worker %d\"}}", first ? "" : ",\n", i, i);
+        first = 0;
+
+        // The slot being written may be mid-update, stop one short of it
+        const unsigned long long head = __atomic_load_n(&trace->ring_head, __ATOMIC_ACQUIRE);
+        const unsigned long long count = head < TRACE_RING_SIZE ? head : TRACE_RING_SIZE - 1;
+        for(unsigned long long n = head - count; n < head; n++){
+            const trace_event *event = &trace->ring[n % TRACE_RING_SIZE];
+            fprintf(out, ",\n{\"name\": \"job\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+                         "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"queue_wait_us\": %.3f}}",
+                    i, event->started_ns / 1e3, (event->finished_ns - event->started_ns) / 1e3,
+                    (event->started_ns - event->enqueued_ns) / 1e3);
+        }
+    }
+
+    fprintf(out, "\n], \"otherData\": {\"histogram_buckets\": \"bucket b counts durations in [2^(b-1), 2^b) ns\", "
+                 "\"workers\": [\n");
+    for(int i = 0; i < from_me->num_threads; i++){
+        worker_trace *trace = &from_me->traces[i];
+        const unsigned long long busy = TRACE_READ(trace->busy_ns);
+        const unsigned long long idle = TRACE_READ(trace->idle_ns);
+        fprintf(out, "%s{\"worker\": %d, \"jobs\": %llu, \"busy_ns\": %llu, \"idle_ns\": %llu, "
+                     "\"busy_ratio\": %.4f, ", i ? ",\n" : "", i, TRACE_READ(trace->jobs), busy, idle,
+                busy + idle ? (double)busy / (busy + idle) : 0.0);
+        dump_histogram(out, "queue_wait", trace->wait_hist);
+        fprintf(out, ", ");
+        dump_histogram(out, "run_time", trace->run_hist);
+        fprintf(out, "}");
+    }
+    fprintf(out, "\n]}}\n");
+}
+#endif
+
 void destroy_threadpool(threadpool* destroyme){
     pthread_mutex_lock(&destroyme->qlock);
 
@@ -184,6 +341,9 @@ void destroy_threadpool(threadpool* destroyme){
 
     // Free threads array
     free(destroyme->threads);
+#ifdef THREADPOOL_TRACE
+    free(destroyme->traces);
+#endif
 
     // Destroy mutex and condition variables
     pthread_mutex_destroy(&(destroyme->qlock));
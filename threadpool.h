@@ -1,4 +1,8 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
 #include <pthread.h>
+#include <stdio.h>
 
 /**
  * threadpool.h
@@ -11,6 +15,36 @@
 #define MAXT_IN_POOL 200
 #define MAXW_IN_QUEUE 200
 
+#ifdef THREADPOOL_TRACE
+// log2(nanoseconds) histogram buckets, the last one catches everything above
+#define TRACE_BUCKETS 40
+// jobs remembered per worker for the trace dump, a power of two
+#define TRACE_RING_SIZE 4096
+
+/**
+ * One finished job, in CLOCK_MONOTONIC nanoseconds
+ */
+typedef struct trace_event_st {
+    unsigned long long enqueued_ns;
+    unsigned long long started_ns;
+    unsigned long long finished_ns;
+} trace_event;
+
+/**
+ * Per-worker statistics. Only the owning worker writes them,
+ * threadpool_trace_dump reads them while the pool runs.
+ */
+typedef struct worker_trace_st {
+    _Alignas(64) unsigned long long jobs;
+    unsigned long long busy_ns;     //time spent running routines
+    unsigned long long idle_ns;     //time spent waiting for a job
+    unsigned long long wait_hist[TRACE_BUCKETS];    //queue-wait, dispatch to start
+    unsigned long long run_hist[TRACE_BUCKETS];     //routine execution time
+    unsigned long long ring_head;   //events ever written, ring index is head % size
+    trace_event ring[TRACE_RING_SIZE];
+} worker_trace;
+#endif
+
 /**
  * the pool holds a queue of this structure
  */
@@ -18,6 +52,9 @@ typedef struct work_st{
     int (*routine) (void*);  //the threads process function
     void * arg;  //argument to the function
     struct work_st* next;
+#ifdef THREADPOOL_TRACE
+    unsigned long long enqueued_ns;  //when dispatch queued the job
+#endif
 } work_t;
 
 
@@ -37,6 +74,10 @@ typedef struct _threadpool_st {
     pthread_cond_t q_not_full;      //full conditional variable
     int shutdown;            //1 if the pool is in distruction process
     int dont_accept;       //1 if destroy function has begun
+#ifdef THREADPOOL_TRACE
+    worker_trace *traces;   //one per thread
+    int next_worker;        //hands out trace slots to starting threads
+#endif
 } threadpool;
 
 
@@ -75,6 +116,19 @@ threadpool* create_threadpool(int num_threads_in_pool, int max_queue_size);
  */
 void dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg);
 
+/**
+ * try_dispatch is dispatch for callers that must never block, such as
+ * an event loop. Instead of waiting for room in a full queue it gives up.
+ * returns 0 if the job was queued, -1 if the queue is full or the pool
+ * is being destroyed (the caller still owns "arg").
+ */
+int try_dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg);
+
+/**
+ * threadpool_queue_size returns the number of jobs waiting in the queue.
+ */
+int threadpool_queue_size(threadpool* from_me);
+
 /**
  * The work function of the thread
  * this function should:
@@ -88,6 +142,16 @@ void dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg);
 void* do_work(void* p);
 
 
+#ifdef THREADPOOL_TRACE
+/**
+ * threadpool_trace_dump writes the recent jobs of every worker as
+ * Chrome/Perfetto trace JSON ("traceEvents"), with the queue-wait and
+ * run-time histograms and busy/idle times under "otherData".
+ * Meant to be called from normal context, not from a signal handler.
+ */
+void threadpool_trace_dump(threadpool* from_me, FILE* out);
+#endif
+
 /**
  * destroy_threadpool kills the threadpool, causing
  * all threads in it to commit suicide, and then
@@ -95,4 +159,4 @@ void* do_work(void* p);
  */
 void destroy_threadpool(threadpool* destroyme);
 
-
+#endif
@@ -0,0 +1,121 @@
+#include "timer_wheel.h"
+#include <stddef.h>
+
+static void list_init(timer_node *head) {
+    head->next = head;
+    head->prev = head;
+}
+
+static void list_append(timer_node *head, timer_node *node) {
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+static void list_unlink(timer_node *node) {
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->next = NULL;
+    node->prev = NULL;
+}
+
+// Picks the slot for "timer" relative to the current tick
+static void place(timer_wheel *wheel, timer_node *timer) {
+    unsigned long long delta = timer->expires - wheel->now;
+    const unsigned long long max_delta = (1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    if (delta > max_delta) {
+        timer->expires = wheel->now + max_delta;
+        delta = max_delta;
+    }
+
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (1ULL << (WHEEL_BITS * (level + 1))))
+        level++;
+    const int slot = (int)((timer->expires >> (WHEEL_BITS * level)) & WHEEL_MASK);
+    list_append(&wheel->slots[level][slot], timer);
+}
+
+void timer_wheel_init(timer_wheel *wheel, unsigned long long now) {
+    wheel->now = now;
+    wheel->count = 0;
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < WHEEL_SLOTS; slot++)
+            list_init(&wheel->slots[level][slot]);
+    }
+}
+
+void timer_init(timer_node *timer) {
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->expires = 0;
+}
+
+int timer_pending(const timer_node *timer) {
+    return timer->next != NULL;
+}
+
+void timer_add(timer_wheel *wheel, timer_node *timer, unsigned long long expires) {
+    if (timer_pending(timer))
+        list_unlink(timer);
+    else
+        wheel->count++;
+
+    timer->expires = expires > wheel->now ? expires : wheel->now + 1;
+    place(wheel, timer);
+}
+
+void timer_remove(timer_wheel *wheel, timer_node *timer) {
+    if (!timer_pending(timer))
+        return;
+    list_unlink(timer);
+    wheel->count--;
+}
+
+// Moves every timer of a higher level slot down to where it now belongs
+static void cascade(timer_wheel *wheel, int level, int slot) {
+    timer_node pending;
+    timer_node *head = &wheel->slots[level][slot];
+    if (head->next == head)
+        return;
+
+    // Detach the whole slot first, re-placing may append to this same list
+    pending.next = head->next;
+    pending.prev = head->prev;
+    pending.next->prev = &pending;
+    pending.prev->next = &pending;
+    list_init(head);
+
+    while (pending.next != &pending) {
+        timer_node *timer = pending.next;
+        list_unlink(timer);
+        place(wheel, timer);
+    }
+}
+
+void timer_advance(timer_wheel *wheel, unsigned long long now, timer_fn expire, void *arg) {
+    while (wheel->now < now) {
+        // Nothing scheduled, jump straight to the target tick
+        if (wheel->count == 0) {
+            wheel->now = now;
+            return;
+        }
+
+        wheel->now++;
+
+        // When a level wraps, pull the next slot of the level above into it
+        for (int level = 1; level < WHEEL_LEVELS; level++) {
+            if ((wheel->now & ((1ULL << (WHEEL_BITS * level)) - 1)) != 0)
+                break;
+            cascade(wheel, level, (int)((wheel->now >> (WHEEL_BITS * level)) & WHEEL_MASK));
+        }
+
+        timer_node *head = &wheel->slots[0][wheel->now & WHEEL_MASK];
+        while (head->next != head) {
+            timer_node *timer = head->next;
+            list_unlink(timer);
+            wheel->count--;
+            expire(timer, arg);
+        }
+    }
+}
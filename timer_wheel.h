@@ -0,0 +1,73 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+/**
+ * timer_wheel.h
+ *
+ * A hierarchical hashed timer wheel. Timers are intrusive nodes embedded
+ * in the object they time out, so adding and removing one is O(1) with
+ * no allocation. Level 0 has one slot per tick; every higher level covers
+ * WHEEL_SLOTS times the range of the one below it, and its slots are
+ * cascaded down as time reaches them.
+ */
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4  //2^24 ticks of range, later deadlines are clamped
+
+/**
+ * A timer. Embed it in the owning structure and recover the owner
+ * in the expiry callback with offsetof.
+ */
+typedef struct timer_node_st {
+    struct timer_node_st *next;
+    struct timer_node_st *prev;
+    unsigned long long expires;     //tick at which the timer fires
+} timer_node;
+
+typedef void (*timer_fn)(timer_node *timer, void *arg);
+
+/**
+ * The wheel. Each slot is the sentinel of a circular list.
+ */
+typedef struct timer_wheel_st {
+    unsigned long long now;         //last tick processed
+    int count;                      //number of pending timers
+    timer_node slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} timer_wheel;
+
+/**
+ * timer_wheel_init prepares an empty wheel whose clock starts at "now".
+ */
+void timer_wheel_init(timer_wheel *wheel, unsigned long long now);
+
+/**
+ * timer_init marks a node as not scheduled. Call it once before first use.
+ */
+void timer_init(timer_node *timer);
+
+/**
+ * timer_add schedules "timer" to fire at tick "expires", rescheduling it
+ * if it was already pending. Deadlines in the past fire on the next tick.
+ */
+void timer_add(timer_wheel *wheel, timer_node *timer, unsigned long long expires);
+
+/**
+ * timer_remove cancels "timer". Does nothing if it is not pending.
+ */
+void timer_remove(timer_wheel *wheel, timer_node *timer);
+
+/**
+ * timer_pending returns 1 if "timer" is scheduled.
+ */
+int timer_pending(const timer_node *timer);
+
+/**
+ * timer_advance moves the clock forward to "now", calling "expire" for
+ * every timer whose deadline has passed. The timer is already removed
+ * when the callback runs, so the callback may free or reschedule it.
+ */
+void timer_advance(timer_wheel *wheel, unsigned long long now, timer_fn expire, void *arg);
+
+#endif
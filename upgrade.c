@@ -0,0 +1,168 @@
+#define _GNU_SOURCE
+#include "upgrade.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+static pid_t child = -1;        //new process, until it is ready
+static int inherited = -1;      //channel to the old process, in the new one
+
+// The environment with our variable set to "fd", built before fork so the child only has to exec
+static char **upgrade_environment(const int fd) {
+    size_t count = 0;
+    while (environ[count] != NULL)
+        count++;
+    char **env = malloc((count + 2) * sizeof(char *));
+    char *var = malloc(sizeof(UPGRADE_ENV) + 16);
+    if (env == NULL || var == NULL) {
+        free(env);
+        free(var);
+        return NULL;
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (strncmp(environ[i], UPGRADE_ENV "=", sizeof(UPGRADE_ENV)) != 0)
+            env[n++] = environ[i];
+    }
+    snprintf(var, sizeof(UPGRADE_ENV) + 16, "%s=%d", UPGRADE_ENV, fd);
+    env[n++] = var;
+    env[n] = NULL;
+    return env;
+}
+
+int upgrade_start(const char *exe, char *const argv[], const int *fds, const int count) {
+    if (child > 0 || count <= 0 || count > UPGRADE_MAX_FDS)
+        return -1;
+    int channel[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, channel) != 0)
+        return -1;
+    char **env = upgrade_environment(channel[1]);
+    if (env == NULL) {
+        close(channel[0]);
+        close(channel[1]);
+        return -1;
+    }
+
+    // Only async-signal-safe calls between fork and exec, other threads may hold locks
+    const pid_t pid = fork();
+    if (pid == 0) {
+        fcntl(channel[1], F_SETFD, 0);
+        execve(exe, argv, env);
+        _exit(127);
+    }
+    size_t last = 0;
+    while (env[last + 1] != NULL)
+        last++;
+    free(env[last]);    // the variable we added, the rest belongs to environ
+    free(env);
+    close(channel[1]);
+    if (pid < 0) {
+        close(channel[0]);
+        return -1;
+    }
+
+    // The sockets travel with the message, their numbers in this process do not matter
+    char control[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)] = {0};
+    char byte = 0;
+    struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = CMSG_SPACE(sizeof(int) * count),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+    if (sendmsg(channel[0], &msg, MSG_NOSIGNAL) != 1) {
+        close(channel[0]);
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+
+    child = pid;
+    fcntl(channel[0], F_SETFL, O_NONBLOCK);
+    return channel[0];
+}
+
+int upgrade_finish(const int channel) {
+    char byte;
+    const ssize_t n = read(channel, &byte, 1);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return 0;
+    close(channel);
+    if (n == 1) {
+        child = -1;     // on its own now, init reaps it after we exit
+        return 1;
+    }
+
+    // Exited or failed before warming up
+    waitpid(child, NULL, 0);
+    child = -1;
+    return -1;
+}
+
+void upgrade_abort(const int channel) {
+    close(channel);
+    if (child > 0) {
+        kill(child, SIGTERM);
+        waitpid(child, NULL, 0);
+        child = -1;
+    }
+}
+
+int upgrade_inherit(int *fds, const int max) {
+    const char *value = getenv(UPGRADE_ENV);
+    if (value == NULL)
+        return 0;
+    inherited = atoi(value);
+    unsetenv(UPGRADE_ENV);
+    fcntl(inherited, F_SETFD, FD_CLOEXEC);
+
+    char control[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)];
+    char byte;
+    struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    ssize_t n;
+    while ((n = recvmsg(inherited, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {}
+    const struct cmsghdr *cmsg = n == 1 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        return -1;
+
+    const int count = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+    int received[UPGRADE_MAX_FDS];
+    memcpy(received, CMSG_DATA(cmsg), sizeof(int) * count);
+    for (int i = 0; i < count; i++) {
+        if (i < max)
+            fds[i] = received[i];
+        else
+            close(received[i]);
+    }
+    return count < max ? count : max;
+}
+
+void upgrade_ready() {
+    if (inherited < 0)
+        return;
+    const char byte = 1;
+    while (write(inherited, &byte, 1) < 0 && errno == EINTR) {}
+    close(inherited);
+    inherited = -1;
+}
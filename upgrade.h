@@ -0,0 +1,54 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+/**
+ * upgrade.h
+ *
+ * Zero-downtime binary upgrade. The running server starts the binary
+ * again and passes its listening sockets to it over a Unix socket with
+ * SCM_RIGHTS, so the listen queue is never closed. The new process warms
+ * up, then writes one byte back; only then does the old process stop
+ * accepting, finish its in-flight requests and exit.
+ *
+ * The new process finds its end of the Unix socket in HTTP_SERVER_UPGRADE_FD.
+ */
+
+#define UPGRADE_ENV "HTTP_SERVER_UPGRADE_FD"
+#define UPGRADE_MAX_FDS 16          //listening sockets passed at once
+
+/**
+ * upgrade_start runs "exe" with "argv" and the current environment, and
+ * sends it the "count" descriptors in "fds". Returns the descriptor the
+ * ready byte arrives on, to be polled by the caller, or -1 on failure.
+ */
+int upgrade_start(const char *exe, char *const argv[], const int *fds, int count);
+
+/**
+ * upgrade_finish reads the channel returned by upgrade_start once it is
+ * readable. Returns 1 if the new process is ready and 0 if not yet. On
+ * -1 the new process failed to start; the channel is closed and the
+ * caller keeps serving.
+ */
+int upgrade_finish(int channel);
+
+/**
+ * upgrade_abort stops a new process started by upgrade_start before it
+ * is ready and closes "channel", so a later upgrade can be started.
+ */
+void upgrade_abort(int channel);
+
+/**
+ * upgrade_inherit receives up to "max" listening sockets from the old
+ * process into "fds". Returns their number, 0 if this process was not
+ * started by an upgrade, or -1 on failure.
+ */
+int upgrade_inherit(int *fds, int max);
+
+/**
+ * upgrade_ready tells the old process to hand over. Call it once the
+ * caches are warm, just before accepting. Does nothing if this process
+ * was not started by an upgrade.
+ */
+void upgrade_ready();
+
+#endif
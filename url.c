@@ -0,0 +1,59 @@
+#include "url.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+int validate_and_parse_url(char *url, URL *url_struct) {
+    url_struct->port = 80; // Default HTTP port
+
+    // Check if URL starts with "http://"
+    char *prefix = "http://";
+    if (strncmp(url, prefix, strlen(prefix)) != 0) {
+        return -1;
+    }
+
+    // Skip "http://"
+    char *domain_start = url + strlen(prefix);
+    char *p = domain_start;
+
+    // Extract domain
+    while (*p && *p != ':' && *p != '/' && *p != '\0') {
+        p++;
+    }
+    if (p == domain_start) {
+        return -1; // Empty domain
+    }
+
+    int domain_length = p - domain_start;
+
+    // Check for port
+    if (*p == ':') {
+        p++;
+        const char *port_start = p;
+
+        // Ensure port is numeric
+        while (isdigit(*p)) p++;
+
+        if (port_start == p || (*p != '/' && *p != '\0')) {
+            return -1;
+        }
+
+        int port = atoi(port_start);
+        if (port <= 0 || port >= 65536) {
+            return -1;
+        }
+        url_struct->port = port;
+    }
+
+    // Check for path
+    if (*p == '/') {
+        url_struct->path = p + 1;
+    } else {
+        url_struct->path = "";
+    }
+
+    url_struct->domain = domain_start;
+    url_struct->domain[domain_length] = '\0';
+
+    return 0;
+}
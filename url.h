@@ -0,0 +1,29 @@
+#ifndef URL_H
+#define URL_H
+
+/**
+ * url.h
+ *
+ * Parsing of "http://host[:port][/path]" URLs, shared by the client and
+ * the server's proxy mode.
+ */
+
+// Struct for representing a parsed URL
+typedef struct URL {
+    char *domain;  // Domain name
+    int port;      // Port number
+    char *path;    // Path in the URL, without the leading '/'
+} URL;
+
+/**
+ * Validates and parses a URL into its components. The domain is
+ * null-terminated in place, so "url" must be writable and outlive the
+ * result.
+ *
+ * @param url The input URL string.
+ * @param url_struct Pointer to the URL structure to populate.
+ * @return 0 on success, -1 on failure.
+ */
+int validate_and_parse_url(char *url, URL *url_struct);
+
+#endif
@@ -1,82 +1,260 @@
+; Minimal static server: answers every connection with index.html.
+; One process per CPU, each with its own SO_REUSEPORT listener, so the
+; kernel spreads connections without a shared accept queue. The header,
+; Content-Length included, is built once at startup; a request costs
+; accept4, read, sendto (MSG_MORE), sendfile and close.
+;
+; nasm -f elf64 webserver.asm -o webserver.o && ld webserver.o -o webserver
+
+%define SYS_READ            0
+%define SYS_OPEN            2
+%define SYS_CLOSE           3
+%define SYS_FSTAT           5
+%define SYS_SENDFILE        40
+%define SYS_SOCKET          41
+%define SYS_SENDTO          44
+%define SYS_BIND            49
+%define SYS_LISTEN          50
+%define SYS_SETSOCKOPT      54
+%define SYS_FORK            57
+%define SYS_EXIT            60
+%define SYS_PRCTL           157
+%define SYS_SCHED_GETAFFINITY 204
+%define SYS_ACCEPT4         288
+
+%define AF_INET             2
+%define SOCK_STREAM         1
+%define SOCK_CLOEXEC        0x80000
+%define SOL_SOCKET          1
+%define SO_REUSEADDR        2
+%define SO_REUSEPORT        15
+%define MSG_MORE            0x8000
+%define PR_SET_PDEATHSIG    1
+%define SIGKILL             9
+%define STAT_SIZE           48      ; offset of st_size in struct stat
+%define MAX_PROCESSES       64
+
 section .data
-    hdr    db "HTTP/1.0 200 OK",13,10,13,10
+    hdr    db "HTTP/1.1 200 OK",13,10
+           db "Server: webserver/1.0",13,10
+           db "Content-Type: text/html",13,10
+           db "Connection: close",13,10
+           db "Content-Length: "
     hdrlen equ $-hdr
+    tail   db 13,10,13,10
+    taillen equ $-tail
     file   db "index.html",0
+    one    dd 1
     ; sockaddr_in structure for AF_INET, port 8080:
     ; sin_family = AF_INET (2)
     ; sin_port = htons(8080) = 0x901F (in little-endian)
     addr   dw 2,0x901F     ; sin_family, sin_port
            dd 0          ; sin_addr (0 for INADDR_ANY)
            dq 0          ; padding
-    buf    times 20 db 0   ; allocate 20 bytes for the file content
+
+section .bss
+    header resb 256     ; hdr + Content-Length digits + tail
+    stat   resb 144     ; struct stat
+    cpus   resb 128     ; CPU affinity mask
+    offset resq 1       ; sendfile offset, rewound for every client
+    buf    resb 4096    ; request, read and discarded
 
 section .text
     global _start
 _start:
-    ; Create socket: socket(AF_INET, SOCK_STREAM, 0)
-    mov   rax, 41      ; sys_socket
-    mov   rdi, 2       ; AF_INET
-    mov   rsi, 1       ; SOCK_STREAM
-    xor   rdx, rdx     ; protocol 0
+    ; Open index.html once: open("index.html", O_RDONLY)
+    mov   rax, SYS_OPEN
+    lea   rdi, [rel file]
+    xor   rsi, rsi
+    syscall
+    test  rax, rax
+    js    .fail
+    mov   r13, rax     ; file fd, shared by every process
+
+    ; Its size: fstat(file, &stat)
+    mov   rax, SYS_FSTAT
+    mov   rdi, r13
+    lea   rsi, [rel stat]
+    syscall
+    test  rax, rax
+    js    .fail
+    mov   r15, [rel stat + STAT_SIZE]
+
+    ; header = hdr + decimal size + tail
+    lea   rdi, [rel header]
+    lea   rsi, [rel hdr]
+    mov   rcx, hdrlen
+    rep   movsb
+
+    ; Digits come out last first, push them and pop in order
+    mov   rax, r15
+    mov   r8, 10
+    xor   rcx, rcx
+.digit:
+    xor   rdx, rdx
+    div   r8
+    add   dl, '0'
+    push  rdx
+    inc   rcx
+    test  rax, rax
+    jnz   .digit
+.store:
+    pop   rax
+    stosb
+    loop  .store
+
+    lea   rsi, [rel tail]
+    mov   rcx, taillen
+    rep   movsb
+    lea   rax, [rel header]
+    sub   rdi, rax
+    mov   r14, rdi     ; header length
+
+    ; Count usable CPUs: sched_getaffinity(0, 128, cpus) returns the mask size
+    mov   rax, SYS_SCHED_GETAFFINITY
+    xor   rdi, rdi
+    mov   rsi, 128
+    lea   rdx, [rel cpus]
+    syscall
+    mov   rcx, 1
+    test  rax, rax
+    jle   .fork
+    xor   rcx, rcx
+    xor   r9, r9
+    lea   r11, [rel cpus]
+.mask_byte:
+    movzx r8, byte [r11 + r9]
+.mask_bit:
+    test  r8, r8
+    jz    .mask_next
+    lea   r10, [r8 - 1]
+    and   r8, r10      ; clear the lowest set bit
+    inc   rcx
+    jmp   .mask_bit
+.mask_next:
+    inc   r9
+    cmp   r9, rax
+    jb    .mask_byte
+    cmp   rcx, MAX_PROCESSES
+    jbe   .fork
+    mov   rcx, MAX_PROCESSES
+
+.fork:
+    ; The first process serves too, fork one child per remaining CPU
+    mov   rbx, rcx
+.fork_loop:
+    dec   rbx
+    jz    .listen
+    mov   rax, SYS_FORK
+    syscall
+    test  rax, rax
+    js    .listen
+    jnz   .fork_loop
+
+    ; Child: die with the parent, then go serve
+    mov   rax, SYS_PRCTL
+    mov   rdi, PR_SET_PDEATHSIG
+    mov   rsi, SIGKILL
+    syscall
+
+.listen:
+    ; Every process binds its own socket: socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)
+    mov   rax, SYS_SOCKET
+    mov   rdi, AF_INET
+    mov   rsi, SOCK_STREAM | SOCK_CLOEXEC
+    xor   rdx, rdx
     syscall
-    mov   r12, rax     ; save socket fd in r12
+    test  rax, rax
+    js    .fail
+    mov   r12, rax     ; listening socket
+
+    ; setsockopt(socket, SOL_SOCKET, SO_REUSEADDR / SO_REUSEPORT, &one, 4)
+    mov   rax, SYS_SETSOCKOPT
+    mov   rdi, r12
+    mov   rsi, SOL_SOCKET
+    mov   rdx, SO_REUSEADDR
+    lea   r10, [rel one]
+    mov   r8, 4
+    syscall
+    mov   rax, SYS_SETSOCKOPT
+    mov   rdx, SO_REUSEPORT
+    syscall
+    test  rax, rax
+    js    .fail
 
     ; Bind: bind(socket, addr, 16)
-    mov   rax, 49      ; sys_bind
+    mov   rax, SYS_BIND
     mov   rdi, r12
-    mov   rsi, addr
+    lea   rsi, [rel addr]
     mov   rdx, 16
     syscall
+    test  rax, rax
+    js    .fail
 
-    ; Listen: listen(socket, 10)
-    mov   rax, 50      ; sys_listen
+    ; Listen: listen(socket, 4096)
+    mov   rax, SYS_LISTEN
     mov   rdi, r12
-    mov   rsi, 10
+    mov   rsi, 4096
     syscall
+    test  rax, rax
+    js    .fail
 
 .accept_loop:
-    ; Accept connection: accept(socket, NULL, NULL)
-    mov   rax, 43      ; sys_accept
+    ; Accept connection: accept4(socket, NULL, NULL, SOCK_CLOEXEC)
+    mov   rax, SYS_ACCEPT4
     mov   rdi, r12
     xor   rsi, rsi
     xor   rdx, rdx
+    mov   r10, SOCK_CLOEXEC
     syscall
+    test  rax, rax
+    js    .accept_loop
     mov   rbx, rax     ; client socket fd in rbx
 
-    ; Write HTTP header: write(client, hdr, hdrlen)
-    mov   rax, 1       ; sys_write
+    ; Read the request, closing with it unread would reset the connection
+    mov   rax, SYS_READ
     mov   rdi, rbx
-    mov   rsi, hdr
-    mov   rdx, hdrlen
-    syscall
-
-    ; Open index.html: open("index.html", O_RDONLY)
-    mov   rax, 2       ; sys_open
-    lea   rdi, [rel file]
-    xor   rsi, rsi     ; flags = O_RDONLY (0)
+    lea   rsi, [rel buf]
+    mov   rdx, 4096
     syscall
-    mov   rcx, rax     ; file descriptor for index.html
+    test  rax, rax
+    jle   .close_client
 
-.read_loop:
-    ; Read file: read(file, buf, 20)
-    mov   rax, 0       ; sys_read
-    mov   rdi, rcx
-    mov   rsi, buf
-    mov   rdx, 20
+    ; Header, held back to share a packet with the body: sendto(client, header, len, MSG_MORE, NULL, 0)
+    mov   rax, SYS_SENDTO
+    mov   rdi, rbx
+    lea   rsi, [rel header]
+    mov   rdx, r14
+    mov   r10, MSG_MORE
+    xor   r8, r8
+    xor   r9, r9
     syscall
     test  rax, rax
-    jle   .shutdown_client
-    ; Write file content: write(client, buf, bytes_read)
-    mov   rdx, rax
-    mov   rax, 1       ; sys_write
+    js    .close_client
+
+    ; Body straight from the page cache: sendfile(client, file, &offset, remaining)
+    mov   qword [rel offset], 0
+.send_loop:
+    mov   rdx, r15
+    sub   rdx, [rel offset]
+    jz    .close_client
+    mov   rax, SYS_SENDFILE
     mov   rdi, rbx
-    mov   rsi, buf
+    mov   rsi, r13
+    lea   r10, [rel offset]
+    xchg  rdx, r10
     syscall
-    jmp   .read_loop
+    test  rax, rax
+    jg    .send_loop
 
-.shutdown_client:
+.close_client:
     ; Close the client socket
-    mov   rax, 3       ; sys_close
+    mov   rax, SYS_CLOSE
     mov   rdi, rbx
     syscall
     jmp   .accept_loop
+
+.fail:
+    mov   rax, SYS_EXIT
+    mov   rdi, 1
+    syscall